@@ -0,0 +1,766 @@
+//
+//  artRun.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef ARTRUN_H
+#define ARTRUN_H
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <type_traits>
+
+#include "run.hpp"
+using namespace std;
+
+// 自适应基数树（Adaptive Radix Tree）做的run，可以代替跳表当memory buffer：LSM<K,V,ARTRun<K,V>>
+// 整数key按字节从高到低逐层往下分，每层最多sizeof(K)次跳转；内部节点按孩子个数用4/16/48/256四种大小，
+// 一串只有一个孩子的节点压成前缀（path compression），子树里只有一个key时直接挂叶子（lazy expansion）
+// 叶子按key从小到大排列，所以也能顺序遍历和seek
+template <class K, class V>
+class ARTRun : public Run<K,V> {
+
+    static_assert(is_integral<K>::value, "ARTRun needs an integral key");
+
+    static const int KEY_BYTES = sizeof(K);
+
+    enum NodeType : uint8_t { LEAF, NODE4, NODE16, NODE48, NODE256 };
+
+    // 被覆盖但还有快照要看的旧版本，从新到老串起来
+    struct Version {
+        V value;
+        uint64_t seq;
+        Version *next;
+    };
+
+    struct Node {
+        NodeType type;
+        Node(NodeType t): type(t) {}
+    };
+
+    struct Leaf : Node {
+        K key;
+        V value;
+        uint64_t seq;   // 写入序号
+        Version *older; // 旧版本，通常为空
+        Leaf(const K &k, const V &v, uint64_t sq): Node(LEAF), key(k), value(v), seq(sq), older(NULL) {}
+        ~Leaf(){
+            while (older){
+                Version *v = older;
+                older = older->next;
+                delete v;
+            }
+        }
+    };
+
+    struct Inner : Node {
+        uint16_t count;              // 孩子个数
+        uint8_t prefixLen;           // 压缩掉的前缀长度；key最多8个字节，前缀整个存得下
+        uint8_t prefix[8];
+        Inner(NodeType t): Node(t), count(0), prefixLen(0) {}
+    };
+
+    // 孩子的字节有序存放，4个以内顺序找，16个以内二分
+    template <int N>
+    struct NodeSmall : Inner {
+        uint8_t keys[N];
+        Node *children[N];
+        NodeSmall(): Inner(N == 4 ? NODE4 : NODE16) {}
+    };
+    typedef NodeSmall<4> Node4;
+    typedef NodeSmall<16> Node16;
+
+    // 256个字节各自记着孩子在children里的下标+1，0表示没有
+    struct Node48 : Inner {
+        uint8_t index[256];
+        Node *children[48];
+        Node48(): Inner(NODE48) {
+            memset(index, 0, sizeof(index));
+        }
+    };
+
+    struct Node256 : Inner {
+        Node *children[256];
+        Node256(): Inner(NODE256) {
+            memset(children, 0, sizeof(children));
+        }
+    };
+
+public:
+
+    // ART上的游标：栈里记着从根走下来经过的每个内部节点和走的是哪个字节，next时回溯到最近还有更大字节的节点
+    // 同一个叶子先给出当前版本，再给出旧版本
+    class Cursor : public RunCursor<K,V> {
+    public:
+        Cursor(ARTRun *tree): _tree(tree), _leaf(NULL), _ver(NULL) {}
+
+        void seek(const K &key){
+            _path.clear();
+            _leaf = NULL;
+            _ver = NULL;
+            uint8_t kb[KEY_BYTES];
+            toBytes(key, kb);
+            Node *n = _tree->_root;
+            int depth = 0;
+            while (n){
+                if (n->type == LEAF){
+                    _leaf = static_cast<Leaf *>(n);
+                    if (_leaf->key < key){
+                        advance();
+                    }
+                    return;
+                }
+                Inner *in = static_cast<Inner *>(n);
+                int c = comparePrefix(in, kb, depth);
+                if (c > 0){
+                    // 整棵子树都比key大，取子树里最小的
+                    descendMin(n);
+                    return;
+                }
+                if (c < 0){
+                    // 整棵子树都比key小，跳到后面的兄弟
+                    advance();
+                    return;
+                }
+                depth += in->prefixLen;
+                int b = kb[depth], nb;
+                Node *child = childAtOrAfter(in, b, nb);
+                if (!child){
+                    advance();
+                    return;
+                }
+                _path.push_back(Frame{in, nb});
+                if (nb > b){
+                    descendMin(child);
+                    return;
+                }
+                n = child;
+                ++depth;
+            }
+        }
+
+        void seekToFirst(){
+            _path.clear();
+            _leaf = NULL;
+            _ver = NULL;
+            if (_tree->_root){
+                descendMin(_tree->_root);
+            }
+        }
+
+        bool valid(){
+            return _leaf != NULL;
+        }
+
+        void next(){
+            Version *nx = _ver ? _ver->next : _leaf->older;
+            if (nx){
+                _ver = nx;
+            }
+            else {
+                _ver = NULL;
+                advance();
+            }
+        }
+
+        K key(){
+            return _leaf->key;
+        }
+
+        V value(){
+            return _ver ? _ver->value : _leaf->value;
+        }
+
+        uint64_t seq(){
+            return _ver ? _ver->seq : _leaf->seq;
+        }
+
+    private:
+        struct Frame {
+            Inner *node;
+            int byte; // 当前走的是哪个字节的孩子
+        };
+
+        // 从n往下一直走最小的孩子，停在叶子上
+        void descendMin(Node *n){
+            while (n->type != LEAF){
+                Inner *in = static_cast<Inner *>(n);
+                int b;
+                n = childAtOrAfter(in, 0, b);
+                _path.push_back(Frame{in, b});
+            }
+            _leaf = static_cast<Leaf *>(n);
+        }
+
+        // 当前叶子（或者栈顶正指着的子树）之后的第一个叶子，没有了_leaf为空
+        void advance(){
+            while (!_path.empty()){
+                Frame &f = _path.back();
+                int nb;
+                Node *child = f.byte < 255 ? childAtOrAfter(f.node, f.byte + 1, nb) : NULL;
+                if (child){
+                    f.byte = nb;
+                    descendMin(child);
+                    return;
+                }
+                _path.pop_back();
+            }
+            _leaf = NULL;
+        }
+
+        ARTRun *_tree;
+        vector<Frame> _path;
+        Leaf *_leaf;
+        Version *_ver; // 为空表示在叶子的当前版本上
+    };
+
+    K min;
+    K max;
+
+    // minKey、maxKey只是为了和跳表的构造函数一样，ART用不到哨兵
+    ARTRun(const K minKey, const K maxKey): min((K) NULL), max((K) NULL), _root(NULL), _n(0), _maxSize(0) {}
+
+    ~ARTRun(){
+        destroy(_root);
+    }
+
+    void insert_key(const K &key, const V &value) {
+        insert_key(key, value, 0, 0);
+    }
+
+    void insert_key(const K &key, const V &value, uint64_t seq, uint64_t snapshotSeq) {
+        if (key > max){
+            max = key;
+        }
+        else if (key < min){
+            min = key;
+        }
+        uint8_t kb[KEY_BYTES];
+        toBytes(key, kb);
+        Node **ref = &_root;
+        int depth = 0;
+        while (true){
+            Node *n = *ref;
+            if (!n){
+                *ref = new Leaf(key, value, seq);
+                ++_n;
+                return;
+            }
+            if (n->type == LEAF){
+                Leaf *leaf = static_cast<Leaf *>(n);
+                if (leaf->key == key){
+                    update(leaf, value, seq, snapshotSeq);
+                    return;
+                }
+                // 两个key从depth开始的公共前缀压进一个新的Node4
+                uint8_t lb[KEY_BYTES];
+                toBytes(leaf->key, lb);
+                Node4 *in = new Node4();
+                int p = 0;
+                while (lb[depth + p] == kb[depth + p]){
+                    in->prefix[p] = kb[depth + p];
+                    ++p;
+                }
+                in->prefixLen = p;
+                addChild(in, lb[depth + p], leaf);
+                addChild(in, kb[depth + p], new Leaf(key, value, seq));
+                *ref = in;
+                ++_n;
+                return;
+            }
+            Inner *in = static_cast<Inner *>(n);
+            int p = 0;
+            while (p < in->prefixLen && in->prefix[p] == kb[depth + p]){
+                ++p;
+            }
+            if (p < in->prefixLen){
+                // 前缀在第p个字节分叉：新建一个Node4放前p个字节，原节点剩下的前缀去掉分叉的那个字节
+                Node4 *top = new Node4();
+                top->prefixLen = p;
+                memcpy(top->prefix, in->prefix, p);
+                uint8_t split = in->prefix[p];
+                in->prefixLen -= p + 1;
+                memmove(in->prefix, in->prefix + p + 1, in->prefixLen);
+                addChild(top, split, in);
+                addChild(top, kb[depth + p], new Leaf(key, value, seq));
+                *ref = top;
+                ++_n;
+                return;
+            }
+            depth += in->prefixLen;
+            Node **child = findChild(in, kb[depth]);
+            if (!child){
+                *ref = addChild(in, kb[depth], new Leaf(key, value, seq));
+                ++_n;
+                return;
+            }
+            ref = child;
+            ++depth;
+        }
+    }
+
+    // 一批按key从小到大排好、没有重复的KV，共用一个写入序号
+    void insert_batch(const KVPair<K,V> *kvs, unsigned long n, uint64_t seq, uint64_t snapshotSeq) {
+        for (unsigned long i = 0; i < n; i++) {
+            insert_key(kvs[i].key, kvs[i].value, seq, snapshotSeq);
+        }
+    }
+
+    void delete_key(const K &key) {
+        uint8_t kb[KEY_BYTES];
+        toBytes(key, kb);
+        // 记下经过的内部节点，删空了要一路往上收
+        Node **refs[KEY_BYTES + 1];
+        int bytes[KEY_BYTES + 1];
+        int top = 0;
+        Node **ref = &_root;
+        int depth = 0;
+        while (*ref && (*ref)->type != LEAF){
+            Inner *in = static_cast<Inner *>(*ref);
+            if (comparePrefix(in, kb, depth) != 0){
+                return;
+            }
+            depth += in->prefixLen;
+            Node **child = findChild(in, kb[depth]);
+            if (!child){
+                return;
+            }
+            refs[top] = ref;
+            bytes[top] = kb[depth];
+            ++top;
+            ref = child;
+            ++depth;
+        }
+        if (!*ref || static_cast<Leaf *>(*ref)->key != key){
+            return;
+        }
+        delete static_cast<Leaf *>(*ref);
+        _n--;
+        *ref = NULL;
+        // 往上收：删空的内部节点整个不要，只剩一个叶子的节点把叶子直接挂到上面去
+        while (top > 0){
+            --top;
+            Inner *parent = static_cast<Inner *>(*refs[top]);
+            removeChild(parent, bytes[top]);
+            if (parent->count == 0){
+                *refs[top] = NULL;
+                freeNode(parent);
+                continue;
+            }
+            if (parent->count == 1){
+                int b;
+                Node *only = childAtOrAfter(parent, 0, b);
+                if (only->type == LEAF){
+                    *refs[top] = only;
+                    freeNode(parent);
+                }
+            }
+            break;
+        }
+    }
+
+    V lookup(const K &searchKey, bool &found) {
+        uint64_t seq;
+        return lookup(searchKey, found, seq, UINT64_MAX);
+    }
+
+    V lookup(const K &searchKey, bool &found, uint64_t &seq, uint64_t asOf) {
+        Leaf *leaf = find(searchKey);
+        if (!leaf){
+            return (V) NULL;
+        }
+        if (leaf->seq <= asOf){
+            found = true;
+            seq = leaf->seq;
+            return leaf->value;
+        }
+        for (Version *v = leaf->older; v; v = v->next){
+            if (v->seq <= asOf){
+                found = true;
+                seq = v->seq;
+                return v->value;
+            }
+        }
+        return (V) NULL;
+    }
+
+    // 所有key的当前版本，按key从小到大
+    vector<KVPair<K,V>> get_all(){
+        vector<KVPair<K,V>> vec;
+        vec.reserve(_n);
+        collect(_root, vec);
+        return vec;
+    }
+
+    // 取出key1 <= key < key2的当前版本
+    vector<KVPair<K,V>> get_all_in_range(const K &key1, const K &key2){
+        vector<KVPair<K,V>> vec;
+        if (key1 > max || key2 < min){
+            return vec;
+        }
+        Cursor c(this);
+        for (c.seek(key1); c.valid() && c.key() < key2; ){
+            KVPair<K,V> kv = {c.key(), c.value(), c.seq()};
+            vec.push_back(kv);
+            // 旧版本不要
+            K k = c.key();
+            while (c.valid() && c.key() == k){
+                c.next();
+            }
+        }
+        return vec;
+    }
+
+    RunCursor<K,V> * cursor(){
+        return new Cursor(this);
+    }
+
+    unsigned long long num_elements() {
+        return _n;
+    }
+
+    K get_min(){
+        return min;
+    }
+
+    K get_max(){
+        return max;
+    }
+
+    void set_size(unsigned long size){
+        _maxSize = size;
+    }
+
+private:
+
+    // 按字节比较和按key比较顺序一致：大端字节序，有符号数翻转符号位
+    static void toBytes(const K &key, uint8_t *out){
+        typedef typename make_unsigned<K>::type U;
+        U u = (U) key;
+        if (is_signed<K>::value){
+            u ^= (U) ((U) 1 << (KEY_BYTES * 8 - 1));
+        }
+        for (int i = KEY_BYTES - 1; i >= 0; --i){
+            out[i] = (uint8_t) (u & 0xff);
+            u >>= 8;
+        }
+    }
+
+    // 节点前缀和key从depth开始的那几个字节比较：前缀大返回1，小返回-1，相同返回0
+    static int comparePrefix(const Inner *in, const uint8_t *kb, int depth){
+        for (int i = 0; i < in->prefixLen; ++i){
+            if (in->prefix[i] != kb[depth + i]){
+                return in->prefix[i] > kb[depth + i] ? 1 : -1;
+            }
+        }
+        return 0;
+    }
+
+    static Node ** findChild(Inner *in, uint8_t b){
+        switch (in->type){
+            case NODE4: {
+                Node4 *n = static_cast<Node4 *>(in);
+                for (int i = 0; i < n->count; ++i){
+                    if (n->keys[i] == b){
+                        return &n->children[i];
+                    }
+                }
+                return NULL;
+            }
+            case NODE16: {
+                Node16 *n = static_cast<Node16 *>(in);
+                int lo = 0, hi = n->count;
+                while (lo < hi){
+                    int mid = (lo + hi) / 2;
+                    if (n->keys[mid] < b){
+                        lo = mid + 1;
+                    }
+                    else {
+                        hi = mid;
+                    }
+                }
+                return lo < n->count && n->keys[lo] == b ? &n->children[lo] : NULL;
+            }
+            case NODE48: {
+                Node48 *n = static_cast<Node48 *>(in);
+                return n->index[b] ? &n->children[n->index[b] - 1] : NULL;
+            }
+            default: {
+                Node256 *n = static_cast<Node256 *>(in);
+                return n->children[b] ? &n->children[b] : NULL;
+            }
+        }
+    }
+
+    // 字节不小于b的第一个孩子，found返回它的字节；没有返回空
+    static Node * childAtOrAfter(Inner *in, int b, int &found){
+        switch (in->type){
+            case NODE4:
+            case NODE16: {
+                uint8_t *keys = in->type == NODE4 ? static_cast<Node4 *>(in)->keys : static_cast<Node16 *>(in)->keys;
+                Node **children = in->type == NODE4 ? static_cast<Node4 *>(in)->children : static_cast<Node16 *>(in)->children;
+                for (int i = 0; i < in->count; ++i){
+                    if (keys[i] >= b){
+                        found = keys[i];
+                        return children[i];
+                    }
+                }
+                return NULL;
+            }
+            case NODE48: {
+                Node48 *n = static_cast<Node48 *>(in);
+                for (int i = b; i < 256; ++i){
+                    if (n->index[i]){
+                        found = i;
+                        return n->children[n->index[i] - 1];
+                    }
+                }
+                return NULL;
+            }
+            default: {
+                Node256 *n = static_cast<Node256 *>(in);
+                for (int i = b; i < 256; ++i){
+                    if (n->children[i]){
+                        found = i;
+                        return n->children[i];
+                    }
+                }
+                return NULL;
+            }
+        }
+    }
+
+    // 加一个孩子，满了换成大一号的节点；返回加完以后的节点（可能是新的）
+    static Inner * addChild(Inner *in, uint8_t b, Node *child){
+        switch (in->type){
+            case NODE4:
+                if (in->count < 4){
+                    insertSorted(static_cast<Node4 *>(in), b, child);
+                    return in;
+                }
+                return addChild(grow16(static_cast<Node4 *>(in)), b, child);
+            case NODE16:
+                if (in->count < 16){
+                    insertSorted(static_cast<Node16 *>(in), b, child);
+                    return in;
+                }
+                return addChild(grow48(static_cast<Node16 *>(in)), b, child);
+            case NODE48: {
+                Node48 *n = static_cast<Node48 *>(in);
+                if (n->count < 48){
+                    // 删过孩子的话中间有空位，找第一个空位
+                    int slot = 0;
+                    while (n->children[slot] && slot < n->count){
+                        ++slot;
+                    }
+                    n->children[slot] = child;
+                    n->index[b] = slot + 1;
+                    ++n->count;
+                    return n;
+                }
+                return addChild(grow256(n), b, child);
+            }
+            default: {
+                Node256 *n = static_cast<Node256 *>(in);
+                n->children[b] = child;
+                ++n->count;
+                return n;
+            }
+        }
+    }
+
+    template <int N>
+    static void insertSorted(NodeSmall<N> *n, uint8_t b, Node *child){
+        int i = n->count;
+        while (i > 0 && n->keys[i - 1] > b){
+            n->keys[i] = n->keys[i - 1];
+            n->children[i] = n->children[i - 1];
+            --i;
+        }
+        n->keys[i] = b;
+        n->children[i] = child;
+        ++n->count;
+    }
+
+    static void copyHeader(Inner *to, const Inner *from){
+        to->count = from->count;
+        to->prefixLen = from->prefixLen;
+        memcpy(to->prefix, from->prefix, from->prefixLen);
+    }
+
+    static Inner * grow16(Node4 *n){
+        Node16 *g = new Node16();
+        copyHeader(g, n);
+        memcpy(g->keys, n->keys, n->count);
+        memcpy(g->children, n->children, n->count * sizeof(Node *));
+        delete n;
+        return g;
+    }
+
+    static Inner * grow48(Node16 *n){
+        Node48 *g = new Node48();
+        copyHeader(g, n);
+        for (int i = 0; i < n->count; ++i){
+            g->children[i] = n->children[i];
+            g->index[n->keys[i]] = i + 1;
+        }
+        for (int i = n->count; i < 48; ++i){
+            g->children[i] = NULL;
+        }
+        delete n;
+        return g;
+    }
+
+    static Inner * grow256(Node48 *n){
+        Node256 *g = new Node256();
+        copyHeader(g, n);
+        for (int b = 0; b < 256; ++b){
+            if (n->index[b]){
+                g->children[b] = n->children[n->index[b] - 1];
+            }
+        }
+        delete n;
+        return g;
+    }
+
+    // 删掉字节b的孩子（孩子本身由调用者处理），节点不缩小
+    static void removeChild(Inner *in, uint8_t b){
+        switch (in->type){
+            case NODE4:
+            case NODE16: {
+                uint8_t *keys = in->type == NODE4 ? static_cast<Node4 *>(in)->keys : static_cast<Node16 *>(in)->keys;
+                Node **children = in->type == NODE4 ? static_cast<Node4 *>(in)->children : static_cast<Node16 *>(in)->children;
+                int i = 0;
+                while (keys[i] != b){
+                    ++i;
+                }
+                for (; i + 1 < in->count; ++i){
+                    keys[i] = keys[i + 1];
+                    children[i] = children[i + 1];
+                }
+                break;
+            }
+            case NODE48: {
+                Node48 *n = static_cast<Node48 *>(in);
+                n->children[n->index[b] - 1] = NULL;
+                n->index[b] = 0;
+                break;
+            }
+            default:
+                static_cast<Node256 *>(in)->children[b] = NULL;
+                break;
+        }
+        --in->count;
+    }
+
+    void update(Leaf *leaf, const V &value, uint64_t seq, uint64_t snapshotSeq){
+        if (seq >= leaf->seq){
+            if (leaf->seq != 0 && leaf->seq <= snapshotSeq){
+                leaf->older = new Version{leaf->value, leaf->seq, leaf->older};
+                ++_n; // 旧版本也要刷到磁盘，算进元素个数
+            }
+            leaf->value = value;
+            leaf->seq = seq;
+        }
+        else if (seq <= snapshotSeq){
+            // 晚到的旧版本（拷贝run的时候），版本链保持从新到老
+            Version **p = &leaf->older;
+            while (*p && (*p)->seq > seq){
+                p = &(*p)->next;
+            }
+            *p = new Version{value, seq, *p};
+            ++_n;
+        }
+    }
+
+    Leaf * find(const K &key){
+        uint8_t kb[KEY_BYTES];
+        toBytes(key, kb);
+        Node *n = _root;
+        int depth = 0;
+        while (n && n->type != LEAF){
+            Inner *in = static_cast<Inner *>(n);
+            if (comparePrefix(in, kb, depth) != 0){
+                return NULL;
+            }
+            depth += in->prefixLen;
+            Node **child = findChild(in, kb[depth]);
+            n = child ? *child : NULL;
+            ++depth;
+        }
+        if (n && static_cast<Leaf *>(n)->key == key){
+            return static_cast<Leaf *>(n);
+        }
+        return NULL;
+    }
+
+    void collect(Node *n, vector<KVPair<K,V>> &vec){
+        if (!n){
+            return;
+        }
+        if (n->type == LEAF){
+            Leaf *leaf = static_cast<Leaf *>(n);
+            KVPair<K,V> kv = {leaf->key, leaf->value, leaf->seq};
+            vec.push_back(kv);
+            return;
+        }
+        Inner *in = static_cast<Inner *>(n);
+        int b = 0, nb;
+        Node *child;
+        while (b < 256 && (child = childAtOrAfter(in, b, nb))){
+            collect(child, vec);
+            b = nb + 1;
+        }
+    }
+
+    // 只释放节点本身，不管孩子
+    static void freeNode(Inner *in){
+        switch (in->type){
+            case NODE4: delete static_cast<Node4 *>(in); break;
+            case NODE16: delete static_cast<Node16 *>(in); break;
+            case NODE48: delete static_cast<Node48 *>(in); break;
+            default: delete static_cast<Node256 *>(in); break;
+        }
+    }
+
+    void destroy(Node *n){
+        if (!n){
+            return;
+        }
+        if (n->type == LEAF){
+            delete static_cast<Leaf *>(n);
+            return;
+        }
+        Inner *in = static_cast<Inner *>(n);
+        int b = 0, nb;
+        Node *child;
+        while (b < 256 && (child = childAtOrAfter(in, b, nb))){
+            destroy(child);
+            b = nb + 1;
+        }
+        freeNode(in);
+    }
+
+    Node *_root;
+    unsigned long long _n;
+    size_t _maxSize;
+};
+
+#endif /* artRun_h */
@@ -30,6 +30,7 @@
 #include <math.h>
 
 #include "MurmurHash.h"
+#include "keyHash.hpp"
 
 using namespace std;
 
@@ -50,8 +51,11 @@ public:
         m_numHashes = (int) ceil( (size / n) * ln2);  // ln(2)
     }
 
-    // 将元素通过Murmur3哈希函数映射生成hash值
+    // 将元素映射生成hash值：整个key时用按key类型选好的哈希（整数key不走Murmur3），别的长度走Murmur3
     array<uint64_t, 2> hash(const Key *data, size_t len) {
+        if (len == sizeof(Key)) {
+            return KeyHash<Key>::hash128(*data);
+        }
 
         // 生成两个hash值
         array<uint64_t, 2> hashValue;
@@ -76,6 +80,20 @@ public:
         }
     }
 
+    // 一批key：先把所有的哈希算出来，再统一置位；两个循环都很紧，编译器和CPU都能流水起来
+    void addBatch(const Key *keys, size_t n) {
+        vector<array<uint64_t, 2>> hashValues(n);
+        for (size_t i = 0; i < n; i++) {
+            hashValues[i] = KeyHash<Key>::hash128(keys[i]);
+        }
+        uint64_t filterSize = m_bits.size();
+        for (size_t i = 0; i < n; i++) {
+            for (int k = 0; k < m_numHashes; k++) {
+                m_bits[nthHash(k, hashValues[i][0], hashValues[i][1], filterSize)] = true;
+            }
+        }
+    }
+
     // 检查是否元素存在
     bool mayContain(const Key *data, size_t len) {
         auto hashValues = hash(data, len);
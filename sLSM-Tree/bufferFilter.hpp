@@ -0,0 +1,241 @@
+//
+//  bufferFilter.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef bufferFilter_h
+#define bufferFilter_h
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include "keyHash.hpp"
+
+using namespace std;
+
+// 一组run共用的过滤器（整个C_0，或者磁盘上的一层）：key哈希出来的32位标签 -> 写过这个标签的最新的run
+// 查一次就知道key最新的版本最多在哪个run里，比它新的run都不用查；没有这个标签的话这组run里肯定没有这个key
+// 两个key标签相同时记的是更新的那个run，查的时候在那个run里没找到再退回到每个run各自的布隆过滤器
+// run代号的做法和BufferIndex一样：第i个run的代号是_base + i，前面的run被合并走时_base往前挪，过期的项顺手复用
+// 表满了换表时不一次搬完：新的项只写新表，每次add顺手从旧表搬MIGRATE_STEP个位置，查的时候新表没有再查旧表
+template <class K>
+class BufferFilter {
+public:
+    // maxElts是这组run最多装多少个KV；不知道的话给个小的，满了会自己扩容
+    BufferFilter(size_t maxElts): _base(FIRST_GEN), _used(0), _live(0), _migrated(0) {
+        size_t cap = 16;
+        while (cap < 2 * maxElts){
+            cap <<= 1;
+        }
+        _table.reset(cap);
+    }
+
+    // key写进了第run个run
+    void add(const K &key, unsigned run){
+        uint32_t tag = tagOf(key);
+        bool hit;
+        Entry *e = place(_table, tag, hit);
+        if (hit){
+            uncount(e->gen);
+        }
+        else {
+            if (e->gen == EMPTY){
+                ++_used;
+            }
+            e->tag = tag;
+            // 还没搬过来的旧项作废，搬的时候看到新表里有这个标签就跳过
+            if (!_old.empty()){
+                const Entry *o = find(_old, tag);
+                if (o){
+                    uncount(o->gen);
+                }
+            }
+        }
+        e->gen = _base + run;
+        count(e->gen);
+        if (!_old.empty()){
+            migrate(MIGRATE_STEP);
+        }
+        if (_used * 4 > _table.size() * 3){
+            grow();
+        }
+    }
+
+    // key最新的版本最多在第几个run里，-1表示这组run里没有
+    int newestRun(const K &key) const {
+        uint32_t tag = tagOf(key);
+        const Entry *e = find(_table, tag);
+        if (!e && !_old.empty()){
+            e = find(_old, tag);
+        }
+        return !e || e->gen < _base ? -1 : (int) (e->gen - _base);
+    }
+
+    // 前n个run被封存或者合并走了，后面的往前挪n个
+    void seal(unsigned n){
+        for (unsigned i = 0; i < n && !_perRun.empty(); ++i){
+            _live -= _perRun.front();
+            _perRun.erase(_perRun.begin());
+        }
+        _base += n;
+    }
+
+private:
+    static const uint32_t EMPTY = 0;
+    static const uint32_t FIRST_GEN = 1;
+    static const size_t MIGRATE_STEP = 16;
+
+    // 一项8个字节
+    struct Entry {
+        uint32_t tag;
+        uint32_t gen; // 所在run的代号，小于_base表示已经过期，EMPTY是空位
+    };
+
+    // 用calloc开表：EMPTY是0，大表直接拿到操作系统清零的页，换表时不用先把几十兆写一遍0
+    struct Table {
+        Entry *slots = NULL;
+        size_t n = 0;
+
+        Table() {}
+        Table(const Table &) = delete;
+        Table &operator=(const Table &) = delete;
+        ~Table(){
+            free(slots);
+        }
+
+        void reset(size_t size){
+            free(slots);
+            slots = size ? (Entry *) calloc(size, sizeof(Entry)) : NULL;
+            n = size;
+        }
+
+        void swap(Table &other){
+            std::swap(slots, other.slots);
+            std::swap(n, other.n);
+        }
+
+        size_t size() const {
+            return n;
+        }
+
+        bool empty() const {
+            return n == 0;
+        }
+
+        Entry &operator[](size_t i){
+            return slots[i];
+        }
+
+        const Entry &operator[](size_t i) const {
+            return slots[i];
+        }
+    };
+
+    static const Entry *find(const Table &table, uint32_t tag){
+        size_t mask = table.size() - 1;
+        for (size_t i = tag & mask; table[i].gen != EMPTY; i = (i + 1) & mask){
+            if (table[i].tag == tag){
+                return &table[i];
+            }
+        }
+        return NULL;
+    }
+
+    // tag所在的项（hit为true）；没有的话是第一个可以复用的过期项，或者探测到的空位
+    Entry *place(Table &table, uint32_t tag, bool &hit){
+        size_t mask = table.size() - 1;
+        size_t i = tag & mask;
+        Entry *reuse = NULL;
+        while (table[i].gen != EMPTY && table[i].tag != tag){
+            if (!reuse && table[i].gen < _base){
+                reuse = &table[i];
+            }
+            i = (i + 1) & mask;
+        }
+        hit = table[i].gen != EMPTY;
+        return hit || !reuse ? &table[i] : reuse;
+    }
+
+    // 每个还没过期的run有多少项，_live是它们的和
+    void count(uint32_t gen){
+        size_t r = gen - _base;
+        if (_perRun.size() <= r){
+            _perRun.resize(r + 1, 0);
+        }
+        ++_perRun[r];
+        ++_live;
+    }
+
+    // 过期的不用管，seal时已经减掉了；_live只用来决定换表时开多大，不用很准
+    void uncount(uint32_t gen){
+        if (gen >= _base && gen - _base < _perRun.size() && _perRun[gen - _base] != 0){
+            --_perRun[gen - _base];
+            --_live;
+        }
+    }
+
+    // 开一张新表，旧表留着慢慢搬；还有很多过期项时新表和旧表一样大，否则翻倍
+    void grow(){
+        if (!_old.empty()){
+            migrate(_old.size());
+        }
+        size_t size = _live * 2 > _table.size() ? _table.size() * 2 : _table.size();
+        _old.swap(_table);
+        _table.reset(size);
+        _used = 0;
+        _migrated = 0;
+    }
+
+    // 从旧表搬最多n个位置到新表；新表里已经有的标签是之后写的，旧的项丢掉，过期的项也丢掉
+    void migrate(size_t n){
+        size_t end = min(_old.size(), _migrated + n);
+        for (; _migrated < end; ++_migrated){
+            const Entry &o = _old[_migrated];
+            if (o.gen == EMPTY || o.gen < _base){
+                continue;
+            }
+            bool hit;
+            Entry *e = place(_table, o.tag, hit);
+            if (!hit){
+                _used += e->gen == EMPTY;
+                *e = o;
+            }
+        }
+        if (_migrated == _old.size()){
+            _old.reset(0);
+        }
+    }
+
+    static uint32_t tagOf(const K &key){
+        return (uint32_t) KeyHash<K>::hash64(key);
+    }
+
+    Table _table;
+    Table _old;       // 换表时还没搬完的旧表，搬完是空的
+    uint32_t _base;           // 第0个run的代号
+    size_t _used;             // 新表里不是空位的项，包括过期的
+    size_t _live;             // 两张表里加起来没过期的标签个数
+    vector<size_t> _perRun;   // 第i个run是多少个标签最新的所在
+    size_t _migrated;         // 旧表前面这么多个位置已经搬完了
+};
+
+#endif /* bufferFilter_h */
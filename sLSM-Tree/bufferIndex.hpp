@@ -0,0 +1,146 @@
+//
+//  bufferIndex.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef bufferIndex_h
+#define bufferIndex_h
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+#include "keyHash.hpp"
+
+using namespace std;
+
+// 整个C_0的哈希索引：key -> 最新版本的value、写入序号和它在哪个跳表里
+// 开放寻址、线性探测；C_0里不管有多少个跳表，查一个key都只要一次探测
+// 每个跳表有一个代号，C_0[i]的代号是_base + i；封存前n个跳表时_base加n，
+// 指向被封存跳表的项自动过期，不用一个一个删，之后插入时顺手复用
+template <class K, class V>
+class BufferIndex {
+public:
+    // maxElts是C_0最多装多少个KV
+    BufferIndex(size_t maxElts): _base(FIRST_GEN), _used(0) {
+        size_t cap = 16;
+        while (cap < 2 * maxElts){
+            cap <<= 1;
+        }
+        _table.resize(cap);
+    }
+
+    // key的最新版本写进了C_0[run]
+    void put(const K &key, const V &value, uint64_t seq, unsigned run){
+        size_t mask = _table.size() - 1;
+        size_t i = hashKey(key) & mask;
+        Entry *reuse = NULL;
+        while (_table[i].gen != EMPTY && _table[i].key != key){
+            if (!reuse && _table[i].gen < _base){
+                reuse = &_table[i];
+            }
+            i = (i + 1) & mask;
+        }
+        Entry *e = &_table[i];
+        if (e->gen == EMPTY){
+            if (reuse){
+                e = reuse;
+            }
+            else {
+                ++_used;
+            }
+        }
+        e->key = key;
+        e->value = value;
+        e->seq = seq;
+        e->gen = _base + run;
+        // 空位太少时线性探测会变慢，把过期的项清掉
+        if (_used * 4 > _table.size() * 3){
+            rebuild();
+        }
+    }
+
+    // 找到的话run返回key的最新版本在C_0的哪个跳表里
+    bool get(const K &key, V &value, uint64_t &seq, unsigned &run) const {
+        size_t mask = _table.size() - 1;
+        for (size_t i = hashKey(key) & mask; _table[i].gen != EMPTY; i = (i + 1) & mask){
+            const Entry &e = _table[i];
+            if (e.key == key){
+                if (e.gen < _base){
+                    return false;
+                }
+                value = e.value;
+                seq = e.seq;
+                run = (unsigned) (e.gen - _base);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // C_0的前n个跳表被封存了，后面的往前挪n个
+    void seal(unsigned n){
+        _base += n;
+    }
+
+private:
+    static const uint64_t EMPTY = 0;     // 从来没用过的空位，探测到这里就停
+    static const uint64_t FIRST_GEN = 1;
+
+    struct Entry {
+        K key;
+        V value;
+        uint64_t seq;
+        uint64_t gen = EMPTY; // 所在跳表的代号，小于_base表示已经过期
+    };
+
+    void rebuild(){
+        vector<Entry> old;
+        old.swap(_table);
+        size_t live = 0;
+        for (size_t i = 0; i < old.size(); ++i){
+            live += old[i].gen >= _base;
+        }
+        // 还活着的就占了一半以上的话再扩容
+        _table.resize(live * 2 > old.size() ? old.size() * 2 : old.size());
+        _used = 0;
+        size_t mask = _table.size() - 1;
+        for (size_t i = 0; i < old.size(); ++i){
+            if (old[i].gen < _base){
+                continue;
+            }
+            size_t j = hashKey(old[i].key) & mask;
+            while (_table[j].gen != EMPTY){
+                j = (j + 1) & mask;
+            }
+            _table[j] = old[i];
+            ++_used;
+        }
+    }
+
+    static uint64_t hashKey(const K &key){
+        return KeyHash<K>::hash64(key);
+    }
+
+    vector<Entry> _table;
+    uint64_t _base;  // C_0[0]的代号
+    size_t _used;    // 不是空位的项，包括过期的
+};
+
+#endif /* bufferIndex_h */
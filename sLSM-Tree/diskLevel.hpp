@@ -28,6 +28,8 @@
 #include <cstring>
 #include "run.hpp"
 #include "diskRun.hpp"
+#include "levelRemix.hpp"
+#include "rateLimiter.hpp"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -37,10 +39,15 @@
 #include <sys/mman.h>
 #include <cassert>
 #include <algorithm>
+#include <climits>
+#include <pthread.h>
+#include "snapshot.hpp"
+#include "bufferFilter.hpp"
 
 #define LEFTCHILD(x) 2 * x + 1
 #define RIGHTCHILD(x) 2 * x + 2
 #define PARENT(x) (x - 1) / 2
+#define IO_CHUNK 4096 // 限速时每写这么多个KV申请一次额度
 
 int TOMBSTONE = INT_MIN;
 
@@ -57,6 +64,17 @@ public: // TODO make some of these private
     KVIntPair_t KVINTPAIRMAX;
     V V_TOMBSTONE = (V) TOMBSTONE;
 
+    // 堆里的顺序：key从小到大；同一个key序号大的（新的）在前，序号一样时run编号大的（新的）在前
+    static bool before(const KVIntPair_t &a, const KVIntPair_t &b){
+        if (a.first.key != b.first.key){
+            return a.first.key < b.first.key;
+        }
+        if (a.first.seq != b.first.seq){
+            return a.first.seq > b.first.seq;
+        }
+        return a.second > b.second;
+    }
+
     // 用堆来表示disk层级关系
     // 好好看看，没看明白
     struct StaticHeap {
@@ -74,7 +92,7 @@ public: // TODO make some of these private
         // 小根堆吧
         void push(KVIntPair_t blob) {
             unsigned i = size++;
-            while(i && blob < arr[PARENT(i)]) {
+            while(i && before(blob, arr[PARENT(i)])) {
                 arr[i] = arr[PARENT(i)] ;
                 i = PARENT(i) ;
             }
@@ -83,8 +101,8 @@ public: // TODO make some of these private
 
         // 数组建堆，应该是小根堆
         void heapify(int i) {
-            int smallest = (LEFTCHILD(i) < size && arr[LEFTCHILD(i)] < arr[i]) ? LEFTCHILD(i) : i ;
-            if(RIGHTCHILD(i) < size && arr[RIGHTCHILD(i)] < arr[smallest]) {
+            int smallest = (LEFTCHILD(i) < size && before(arr[LEFTCHILD(i)], arr[i])) ? LEFTCHILD(i) : i ;
+            if(RIGHTCHILD(i) < size && before(arr[RIGHTCHILD(i)], arr[smallest])) {
                 smallest = RIGHTCHILD(i);
             }
             if(smallest != i) {
@@ -112,10 +130,20 @@ public: // TODO make some of these private
     unsigned _numRuns;      // number of runs in a level
     unsigned _activeRun;    // index of active run
     unsigned _mergeSize;    // # of runs to merge downwards
+    unsigned _maxRuns;      // 原样挪下来的run比合并写出来的小，本层最多可以有这么多个run
     double _bf_fp;          // bloom filter false positive
     vector<DiskRun<K,V> *> runs;
+    vector<unsigned long> _charge; // 每个生效的run占本层多少个KV的额度：合并写出来的占一整个run，原样挪下来的按实际大小
+    unsigned long _used = 0;       // _charge的总和，到_numRuns个run的大小时本层就满了
+    struct MergeJob;
+    MergeJob *_job = nullptr; // 正在合并进本层的任务
+    BufferFilter<K> *_filter = nullptr; // 整层共用的过滤器，查一次就知道从哪个run开始找；为空表示不用
+    LevelRemix<K,V> *_remix = nullptr;  // 整层的有序视图，范围查询在本层只seek一次；为空表示不用
+    LevelRemix<K,V> *_nextRemix = nullptr; // 下一个改动生效后的视图，在磁盘写锁外面建好，生效时只换指针
+    LevelRemix<K,V> *_oldRemix = nullptr;  // 换下来的视图，下次建新视图时再释放，不在磁盘写锁里释放
+    pthread_rwlock_t *_lock;            // 树的磁盘读写锁，往整层的过滤器里加key时拿写锁挡住查找；为空表示没有并发的查找
 
-    DiskLevel<K,V>(unsigned int pageSize, int level, unsigned long runSize, unsigned numRuns, unsigned mergeSize, double bf_fp):_numRuns(numRuns), _runSize(runSize),_level(level), _pageSize(pageSize), _mergeSize(mergeSize), _activeRun(0), _bf_fp(bf_fp){
+    DiskLevel<K,V>(unsigned int pageSize, int level, unsigned long runSize, unsigned numRuns, unsigned mergeSize, double bf_fp, pthread_rwlock_t *lock = nullptr):_numRuns(numRuns), _runSize(runSize),_level(level), _pageSize(pageSize), _mergeSize(mergeSize), _maxRuns(numRuns * max(mergeSize, 1u)), _activeRun(0), _bf_fp(bf_fp), _lock(lock){
         KVPAIRMAX = (KVPair_t) {INT_MAX, 0};
         KVINTPAIRMAX = KVIntPair_t(KVPAIRMAX, -1);
 
@@ -127,82 +155,417 @@ public: // TODO make some of these private
     }
     
     ~DiskLevel<K,V>(){
+        delete _job;
+        delete _filter;
+        delete _remix;
+        delete _nextRemix;
+        delete _oldRemix;
         for (int i = 0; i< runs.size(); ++i){
             delete runs[i];
         }
     }
 
-    // 添加runs
-    // 这个没有完全读懂
-    void addRuns(vector<DiskRun<K, V> *> &runList, const unsigned long runLen, bool lastLevel) {
+    // 一次进行中的合并（增量合并用）：把addRuns的k路归并拆成可以分多次推进的若干步
+    struct MergeJob {
+        vector<DiskRun<K,V> *> runList;
+        StaticHeap h;
+        vector<unsigned long> heads;
+        long j;             // last written index in the target run
+        unsigned long remaining; // 还没处理的KV个数
+        K lastKey;
+        uint64_t lastSeq;   // 上一个留下来的版本的序号
+        bool lastLevel;
+        vector<uint64_t> snapshots; // 开始合并时还活着的快照，从小到大
+        vector<TombstoneSet<K>> newer; // newer[i]：比runList[i]新的run的范围删除标记
+        TombstoneSet<K> tombstones;    // 所有输入的范围删除标记；最后一层只在为快照留下了被盖住的旧版本时才需要
+        bool keptCovered;   // 有被范围删除盖住、但快照还要看的版本留了下来
+        bool move;          // 不重写数据，installMerge时把moved里的run文件直接挪到本层
+        vector<DiskRun<K,V> *> moved; // 要挪下来的run，按key从小到大
+        vector<int> order;  // run之间key不重叠时按key从小到大的run编号，顺着读不用堆；为空表示走堆
+        unsigned cur;       // order里正在读的位置
+        unsigned long filtered;  // 写定的位置里前filtered个已经加进了整层的过滤器
+        unsigned filteredRuns;   // 挪下来的run里前几个已经整个加进了整层的过滤器
 
-        // 相当于这个向量里面_numRuns个KVINTPAIRMAX
-        StaticHeap h = StaticHeap((int) runList.size(), KVINTPAIRMAX);
-        // _numRuns个0
-        vector<int> heads(runList.size(), 0);
-        for (int i = 0; i < runList.size(); i++){
-            // 每个run的map[0]
-            KVPair_t kvp = runList[i]->map[0];
-            // 建堆必经步骤
-            h.push(KVIntPair_t(kvp, i));
+        MergeJob(vector<DiskRun<K,V> *> &runs, KVIntPair_t mx, bool last, const vector<uint64_t> &snaps): runList(runs), h((int) runs.size(), mx), heads(runs.size(), 0), j(-1), remaining(0), lastKey(INT_MAX), lastSeq(0), lastLevel(last), snapshots(snaps), newer(runs.size()), keptCovered(false), move(runs.size() == 1), cur(0), filtered(0), filteredRuns(0) {
+            if (move){
+                moved = runList;
+                return;
+            }
+            for (int i = (int) runList.size() - 2; i >= 0; i--){
+                newer[i] = newer[i + 1];
+                newer[i].merge(runList[i + 1]->tombstones);
+            }
+            // 比最老的快照还早的范围删除，谁都看得到
+            uint64_t oldest = snapshots.empty() ? UINT64_MAX : snapshots.front();
+            for (int i = 0; i < runList.size(); i++){
+                tombstones.merge(runList[i]->tombstones);
+                // 整个run都被更新的范围删除覆盖了，也没有快照要看，直接跳过不读
+                if (runList[i]->getCapacity() == 0 || newer[i].coversRange(runList[i]->minKey, runList[i]->maxKey, oldest)){
+                    continue;
+                }
+                remaining += runList[i]->getCapacity();
+                order.push_back(i);
+            }
+            if (!disjoint()){
+                for (int i = 0; i < order.size(); i++){
+                    // 每个run的map[0]
+                    KVPair_t kvp = runList[order[i]]->entry(0);
+                    // 建堆必经步骤
+                    h.push(KVIntPair_t(kvp, order[i]));
+                }
+                order.clear();
+            }
         }
-        
-        int j = -1;
-        K lastKey = INT_MAX;
-        unsigned lastk = INT_MIN;
-        while (h.size != 0){
-            // 弹出最小值还是最大值啊；最小值吧
-            auto val_run_pair = h.pop();
-            assert(val_run_pair != KVINTPAIRMAX); // TODO delete asserts
-            if (lastKey == val_run_pair.first.key){
-                if( lastk < val_run_pair.second){
-                    runs[_activeRun]->map[j] = val_run_pair.first;
+
+        // 没有范围删除，而且按最小key排好以后每个run都完全在下一个run的前面（顺序写入就是这样）
+        bool disjoint(){
+            for (int i = 0; i < runList.size(); i++){
+                if (!runList[i]->tombstones.empty()){
+                    return false;
                 }
             }
-            else {
-                ++j;
-                // 如果是最后一层而且激活状态的run含有墓碑标记
-                if ( j != -1 && lastLevel && runs[_activeRun]->map[j].value == V_TOMBSTONE){
-                    --j;
+            sort(order.begin(), order.end(), [this](int a, int b){ return runList[a]->minKey < runList[b]->minKey; });
+            for (int i = 0; i + 1 < order.size(); i++){
+                if (!(runList[order[i]]->maxKey < runList[order[i + 1]]->minKey)){
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // 取下一个要处理的KV和它所在的run，全部取完返回false
+        bool next(KVPair_t &kv, unsigned &k){
+            if (!order.empty()){
+                while (cur < order.size() && heads[order[cur]] == runList[order[cur]]->getCapacity()){
+                    ++cur;
                 }
-                runs[_activeRun]->map[j] = val_run_pair.first;
+                if (cur == order.size()){
+                    return false;
+                }
+                k = order[cur];
+                kv = runList[k]->entry(heads[k]++);
+                return true;
+            }
+            if (h.size == 0){
+                return false;
             }
-            
-            lastKey = val_run_pair.first.key;
-            lastk = val_run_pair.second;
-            
-            unsigned k = val_run_pair.second;
+            // 弹出最小值
+            auto val_run_pair = h.pop();
+            assert(val_run_pair != h.max); // TODO delete asserts
+            k = val_run_pair.second;
+            kv = val_run_pair.first;
             if (++heads[k] < runList[k]->getCapacity()){
-                KVPair_t kvp = runList[k]->map[heads[k]];
+                KVPair_t kvp = runList[k]->entry(heads[k]);
                 h.push(KVIntPair_t(kvp, k));
             }
-                
+            return true;
+        }
+    };
+
+    // 添加runs：一次性做完整个合并
+    // 同一个key只留最新的版本，和还活着的快照要看的旧版本
+    void addRuns(vector<DiskRun<K, V> *> &runList, const unsigned long runLen, bool lastLevel, const vector<uint64_t> &snapshots = vector<uint64_t>()) {
+        beginMerge(runList, lastLevel, snapshots);
+        unsigned long budget = ULONG_MAX;
+        stepMerge(budget);
+        installMerge();
+    }
+
+    // 开始把runList合并成本层的一个新run，真正的工作由stepMerge完成
+    void beginMerge(vector<DiskRun<K, V> *> &runList, bool lastLevel, const vector<uint64_t> &snapshots) {
+        assert(_job == nullptr && !levelFull());
+        _job = new MergeJob(runList, KVINTPAIRMAX, lastLevel, snapshots);
+        if (!_job->move && movable(*_job)){
+            for (int i = 0; i < _job->order.size(); i++){
+                _job->moved.push_back(runList[_job->order[i]]);
+            }
+            _job->move = true;
+            _job->remaining = 0;
+        }
+        if (_job->move && _filter){
+            // 挪下来的run不用重写，只要把key加进本层的过滤器，这也按预算做
+            for (int i = 0; i < _job->moved.size(); i++){
+                _job->remaining += _job->moved[i]->getCapacity();
+            }
+        }
+        if (!_job->move){
+            reserveRun();
+            // 输入的块数加起来就是合并结果的上限，范围过滤器不用等合并完再数一遍
+            size_t entries = 0;
+            uint64_t lo = UINT64_MAX, hi = 0;
+            for (int i = 0; i < runList.size(); i++){
+                entries += runList[i]->filterEntries();
+                lo = min(lo, runList[i]->minSeq());
+                hi = max(hi, runList[i]->maxSeq());
+            }
+            // 有快照落在输入的序号中间时，合并结果里同一个key可能留几个版本，要留下每个KV的序号
+            runs[_activeRun]->beginWrite(SnapshotList::visible(snapshots, lo, hi));
+            runs[_activeRun]->beginIndex(entries);
+        }
+    }
+
+    // 几个run之间key不重叠（顺着读的合并），也不和本层已有的run重叠时，合并结果就是把它们原样放下来，
+    // 不用重写，一个个挪到本层就行；空的run留在上一层被释放
+    // 挪下来的run按实际大小算额度，加起来不比合并写出来的一个run多，所以本层不会因此提前满、树也不会变深
+    // 每个run至少要有本层run的1/mergeSize大（上一层合并写满的run），这样本层最多_maxRuns个run正好装满额度；
+    // 已经挪过一次的run比这小，下次一定会被合并，小run不会一路挪到最底层
+    bool movable(MergeJob &m){
+        if (m.order.empty() || _activeRun + m.order.size() > _maxRuns){
+            return false;
+        }
+        for (int i = 0; i < m.order.size(); i++){
+            DiskRun<K,V> *run = m.runList[m.order[i]];
+            if (run->getCapacity() * _mergeSize < _runSize || overlaps(run->minKey, run->maxKey)){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool mergeInProgress(){
+        return _job != nullptr;
+    }
+
+    // 进行中的合并读的是上一层的哪几个run，合并生效后上一层要释放的就是它们
+    vector<DiskRun<K,V> *> mergeInputs(){
+        return _job->runList;
+    }
+
+    // 进行中的合并还剩多少KV没处理
+    unsigned long mergeRemaining(){
+        return _job ? _job->remaining : 0;
+    }
+
+    // 推进合并，最多处理budget个KV，并从budget中扣掉实际用掉的部分
+    // 全部写完返回true；新run要等installMerge之后才对查找可见
+    // limiter不为空时按写入的字节数限速
+    bool stepMerge(unsigned long &budget, RateLimiter *limiter = nullptr) {
+        MergeJob &m = *_job;
+        if (m.move){
+            while (_filter && budget != 0 && m.filteredRuns < m.moved.size()){
+                DiskRun<K,V> *run = m.moved[m.filteredRuns];
+                unsigned long n = min(budget, run->getCapacity() - m.filtered);
+                filterKeys(run, _activeRun + m.filteredRuns, m.filtered, m.filtered + n);
+                m.filtered += n;
+                budget -= n;
+                m.remaining -= min(m.remaining, n);
+                if (m.filtered == run->getCapacity()){
+                    ++m.filteredRuns;
+                    m.filtered = 0;
+                }
+            }
+            return m.filteredRuns == m.moved.size() || !_filter;
+        }
+        DiskRun<K,V> *target = runs[_activeRun];
+        KVPair_t kv;
+        unsigned k;
+        while (budget != 0 && m.next(kv, k)){
+            --budget;
+            --m.remaining;
+            if (limiter && m.remaining % IO_CHUNK == 0){
+                limiter->request(IO_CHUNK * sizeof(DiskPair<K,V>));
+            }
+            bool sameKey = m.j != -1 && m.lastKey == kv.key;
+            // 盖住它的范围删除：更新的run上的，或者同一个run上序号更大的
+            uint64_t deleted = min(m.newer[k].deletedAt(kv.key, kv.seq), m.runList[k]->tombstones.deletedAt(kv.key, kv.seq));
+            if (deleted != UINT64_MAX && !SnapshotList::visible(m.snapshots, kv.seq, deleted)){
+                // deleted by a range tombstone no snapshot predates: drop it without touching lastKey
+            }
+            else if (sameKey && !SnapshotList::visible(m.snapshots, kv.seq, m.lastSeq)){
+                // 同一个key的旧版本，没有快照要看，丢掉
+            }
+            else {
+                m.keptCovered = m.keptCovered || deleted != UINT64_MAX;
+                // 上一个位置已经写定；最后一层不需要保留墓碑：它是那个key最老的版本时直接覆盖掉
+                if (!sameKey && m.j != -1 && m.lastLevel && target->map[m.j].value == V_TOMBSTONE){
+                    --m.j;
+                }
+                else if (m.j != -1){
+                    target->indexEntry(m.j);
+                    if (m.j + 1 - m.filtered >= IO_CHUNK){
+                        filterKeys(target, _activeRun, m.filtered, m.j + 1);
+                        m.filtered = m.j + 1;
+                    }
+                }
+                ++m.j;
+                target->put(m.j, kv);
+                m.lastKey = kv.key;
+                m.lastSeq = kv.seq;
+            }
+        }
+        if (m.remaining != 0){
+            // 写定的位置在这一步里就加进过滤器，生效时不用再过一遍
+            unsigned long done = m.j > 0 ? m.j : 0;
+            filterKeys(target, _activeRun, m.filtered, done);
+            m.filtered = max(m.filtered, done);
+            return false;
         }
         
-        if (lastLevel && runs[_activeRun]->map[j].value == V_TOMBSTONE){
-            --j;
+        if (m.j != -1 && m.lastLevel && target->map[m.j].value == V_TOMBSTONE){
+            --m.j;
         }
-        runs[_activeRun]->setCapacity(j + 1);
-        runs[_activeRun]->constructIndex();
-        if(j + 1 > 0){
+        else if (m.j != -1){
+            target->indexEntry(m.j);
+        }
+        filterKeys(target, _activeRun, m.filtered, m.j + 1);
+        target->setCapacity(m.j + 1);
+        target->endIndex();
+        if (m.lastLevel && !m.keptCovered){
+            m.tombstones.clear();
+        }
+        m.tombstones.compact(m.snapshots);
+        target->tombstones = m.tombstones;
+        return true;
+    }
+
+    // 让合并好的run对查找可见，这是合并里唯一改动读者能看到的状态的一步
+    // 没有KV但带着范围删除标记的run也要保留，它还要盖住更老的层
+    void installMerge() {
+        unsigned first = _activeRun;
+        if (_job->move){
+            // 上一层freeMergedRuns时看到它们已经不是那一层的，不会删掉
+            for (int i = 0; i < _job->moved.size(); i++){
+                placeRun(_job->moved[i]);
+                runInstalled(_activeRun, _job->moved[i]->getCapacity());
+                ++_activeRun;
+            }
+        }
+        else if (mergeKeepsRun()){
+            runInstalled(_activeRun, _runSize);
             ++_activeRun;
         }
-        
+        installRemix(first);
+        delete _job;
+        _job = nullptr;
+    }
+
+    // 合并写完以后，写出来的run要不要装上：空run只有带着范围删除标记时才留
+    bool mergeKeepsRun(){
+        return _job->j + 1 > 0 || !_job->tombstones.empty();
+    }
+
+    // 在磁盘写锁外面建好合并生效后的有序视图，见prepareRemixAdd
+    void prepareMergeRemix(){
+        vector<DiskRun<K,V> *> added;
+        if (_job->move){
+            added = _job->moved;
+        }
+        else if (mergeKeepsRun()){
+            added.push_back(runs[_activeRun]);
+        }
+        prepareRemixAdd(added);
     }
 
     // ？？？
     void addRunByArray(KVPair_t * runToAdd, const unsigned long runLen){
-        assert(_activeRun < _numRuns);
-        assert(runLen == _runSize);
-        runs[_activeRun]->writeData(runToAdd, 0, runLen);
+        writeRunByArray(runToAdd, runLen, TombstoneSet<K>());
+        installRun();
+    }
+
+    // 把数组写进下一个空run并建好索引和整层的有序视图，但还不对查找可见
+    // snapshots是还活着的快照，有快照落在数组的序号中间时留下每个KV的序号
+    void writeRunByArray(KVPair_t * runToAdd, const unsigned long runLen, const TombstoneSet<K> &tombstones, RateLimiter *limiter = nullptr, const vector<uint64_t> &snapshots = vector<uint64_t>()){
+        assert(!levelFull());
+        assert(runLen <= _runSize);
+        reserveRun();
+        uint64_t lo = UINT64_MAX, hi = 0;
+        for (unsigned long i = 0; i < runLen; i++){
+            lo = min(lo, runToAdd[i].seq);
+            hi = max(hi, runToAdd[i].seq);
+        }
+        runs[_activeRun]->beginWrite(SnapshotList::visible(snapshots, lo, hi));
+        for (unsigned long off = 0; off < runLen; off += IO_CHUNK){
+            unsigned long n = min((unsigned long) IO_CHUNK, runLen - off);
+            if (limiter){
+                limiter->request(n * sizeof(DiskPair<K,V>));
+            }
+            runs[_activeRun]->writeData(runToAdd + off, off, n);
+        }
+        runs[_activeRun]->setCapacity(runLen);
         runs[_activeRun]->constructIndex();
+        runs[_activeRun]->tombstones = tombstones;
+        filterKeys(runs[_activeRun], _activeRun, 0, runLen);
+        prepareRemixAdd(vector<DiskRun<K,V> *>(1, runs[_activeRun]));
+    }
+
+    void installRun(){
+        runInstalled(_activeRun, _runSize);
+        _activeRun++;
+        installRemix(_activeRun - 1);
+    }
+
+    // 把一个已经建好索引的run（导入的外部文件）装到下一个空位上，替换掉原来的空run
+    void installRun(DiskRun<K,V> *run){
+        assert(!levelFull() && _job == nullptr);
+        placeRun(run);
+        runInstalled(_activeRun, _runSize);
         _activeRun++;
+        installRemix(_activeRun - 1);
+    }
+
+    // 下一个位置上要有一个空run可以写；本层因为挪下来的run多出了位置时现建一个
+    void reserveRun(){
+        if (_activeRun == runs.size()){
+            runs.push_back(new DiskRun<K,V>(_runSize, _pageSize, _level, _activeRun, _bf_fp));
+        }
+    }
+
+    // 把建好的run放到下一个位置上，替换掉那里的空run，文件跟着改名
+    void placeRun(DiskRun<K,V> *run){
+        if (_activeRun < runs.size()){
+            delete runs[_activeRun];
+            runs[_activeRun] = run;
+        }
+        else {
+            runs.push_back(run);
+        }
+        relabel(run, _activeRun);
+    }
+
+    // 本层有没有run的key范围或者范围删除和[lo, hi]重叠
+    bool overlaps(const K &lo, const K &hi){
+        for (int i = 0; i < _activeRun; i++){
+            if (runs[i]->getCapacity() != 0 && !(runs[i]->maxKey < lo || hi < runs[i]->minKey)){
+                return true;
+            }
+            if (runs[i]->tombstones.overlaps(lo, hi)){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 批量导入：前sizes.size()个空run已经直接写好了有序的数据，并行建索引，key加进整层的过滤器，建好整层的有序视图，还不对查找可见
+    void indexBulkRuns(const vector<unsigned long> &sizes){
+        assert(_activeRun == 0 && sizes.size() <= _numRuns);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int i = 0; i < (int) sizes.size(); i++){
+            runs[i]->setCapacity(sizes[i]);
+            runs[i]->constructIndex();
+        }
+        for (int i = 0; i < (int) sizes.size(); i++){
+            filterKeys(runs[i], i, 0, sizes[i]);
+        }
+        prepareRemixAdd(vector<DiskRun<K,V> *>(runs.begin(), runs.begin() + sizes.size()));
     }
 
-    // 合并mergeSize个runs
+    // 让indexBulkRuns建好的run一起生效
+    void installBulkRuns(const vector<unsigned long> &sizes){
+        for (int i = 0; i < (int) sizes.size(); i++){
+            _charge.push_back(_runSize);
+            _used += _runSize;
+        }
+        _activeRun = (unsigned) sizes.size();
+        installRemix(0);
+    }
+
+    // 合并最老的几个run，它们的额度加起来不超过mergeSize个run，合并结果一定放得进下一层的一个run
+    // 都是合并写出来的run时就是最老的mergeSize个
     vector<DiskRun<K,V> *> getRunsToMerge(){
         vector<DiskRun<K, V> *> toMerge;
-        for (int i = 0; i < _mergeSize; i++){
+        unsigned long share = 0;
+        for (int i = 0; i < _activeRun && (toMerge.empty() || share + _charge[i] <= (unsigned long) _mergeSize * _runSize); i++){
+            share += _charge[i];
             toMerge.push_back(runs[i]);
         }
 
@@ -210,41 +573,194 @@ public: // TODO make some of these private
         
     }
 
-    // 释放已经合并的runs
+    // 释放已经合并的runs，它们是本层最老的那几个
     void freeMergedRuns(vector<DiskRun<K,V> *> &toFree){
-        assert(toFree.size() == _mergeSize);
-        for (int i = 0; i < _mergeSize; i++){
-            assert(toFree[i]->_level == _level);
-            delete toFree[i];
+        unsigned n = (unsigned) toFree.size();
+        for (int i = 0; i < n; i++){
+            assert(toFree[i] == runs[i]);
+            // 被整个挪到下一层的run已经归下一层管了
+            if (toFree[i]->_level == _level){
+                delete toFree[i];
+            }
+            _used -= _charge[i];
         }
         // 删除这层runs中已经合并的run们，后面的元素自动前移补位
-        runs.erase(runs.begin(), runs.begin() + _mergeSize);
-        _activeRun -= _mergeSize;
+        runs.erase(runs.begin(), runs.begin() + n);
+        _charge.erase(_charge.begin(), _charge.begin() + n);
+        _activeRun -= n;
+        if (_filter){
+            _filter->seal(n);
+        }
+        if (_nextRemix){
+            swapRemix();
+        }
+        else if (_remix){
+            _remix->dropOldest(runs, n);
+        }
+        for (int i = 0; i < runs.size(); i++){
+            relabel(runs[i], i);
+        }
+
+        // ok，因为删除了几个run，所以添加几个新run
+        for (int i = (int) runs.size(); i < _numRuns; i++){
+            DiskRun<K, V> * newRun = new DiskRun<K,V>(_runSize, _pageSize, _level, i, _bf_fp);
+            runs.push_back(newRun);
+        }
+    }
+
+    // 把run记成本层的第runID个，文件跟着改名
+    void relabel(DiskRun<K,V> *run, int runID){
+        run->_level = _level;
+        run->_runID = runID;
+
+        // filename重新命名
+        string newName = ("C_" + to_string(run->_level) + "_" + to_string(run->_runID) + ".txt");
+
+        //？前面不应该加一个！吗
+        if (rename(run->_filename.c_str(), newName.c_str())){
+            perror(("Error renaming file " + run->_filename + " to " + newName).c_str());
+            exit(EXIT_FAILURE);
+        }
+        run->_filename = newName;
+    }
+
+    // 打开或者关掉整层的过滤器；打开时把已有的run都加进去
+    void enableFilter(bool on){
+        delete _filter;
+        _filter = nullptr;
+        if (!on){
+            return;
+        }
+        // 不按整层的容量开表，深层的run很大，先开小一点，满了再扩容
+        _filter = new BufferFilter<K>(min(_runSize, (unsigned long) 1 << 16));
+        for (int i = 0; i < _activeRun; i++){
+            addKeys(runs[i], i, 0, runs[i]->getCapacity());
+        }
+        // 进行中的合并已经写定的部分下一步重新加
+        if (_job){
+            _job->filtered = 0;
+            _job->filteredRuns = 0;
+        }
+    }
+
+    // 打开或者关掉整层的有序视图；run太多时一个字节记不下run的编号，不打开
+    void enableRemix(bool on){
+        delete _remix;
+        _remix = nullptr;
+        clearRemixes();
+        if (!on || _maxRuns > LevelRemix<K,V>::MAX_RUNS){
+            return;
+        }
+        _remix = new LevelRemix<K,V>();
+        _remix->rebuild(runs, _activeRun);
+    }
+
+    // 范围查询能不能在本层只用一个游标：视图不管范围删除，有run带着范围删除标记时还是每个run一个游标
+    bool remixUsable(){
+        if (!_remix){
+            return false;
+        }
         for (int i = 0; i < _activeRun; i++){
+            if (!runs[i]->tombstones.empty()){
+                return false;
+            }
+        }
+        return true;
+    }
 
-            runs[i]->_runID = i;
+    // 顺着整层有序视图的游标，remixUsable()时才能用
+    RunCursor<K,V> * remixCursor(){
+        return _remix->cursor(&runs);
+    }
 
-            // filename重新命名
-            string newName = ("C_" + to_string(runs[i]->_level) + "_" + to_string(runs[i]->_runID) + ".txt");
+    // 第i个run生效了：记下它占的额度
+    // 它的key在写run的时候已经加进整层的过滤器了，整层的有序视图由installRemix更新
+    void runInstalled(int i, unsigned long charge){
+        _charge.push_back(charge);
+        _used += charge;
+    }
 
-            //？前面不应该加一个！吗
-            if (rename(runs[i]->_filename.c_str(), newName.c_str())){
-                perror(("Error renaming file " + runs[i]->_filename + " to " + newName).c_str());
-                exit(EXIT_FAILURE);
+    // 在磁盘写锁外面建好added里的run装到本层以后的有序视图：拷一份现在的视图，按装好以后的run数组把它们一个个归并进去
+    // 生效时只换指针；调用时持有合并锁，到生效之前本层的run不会变
+    void prepareRemixAdd(const vector<DiskRun<K,V> *> &added){
+        if (!_remix){
+            return;
+        }
+        clearRemixes();
+        vector<DiskRun<K,V> *> after(runs.begin(), runs.begin() + _activeRun);
+        after.insert(after.end(), added.begin(), added.end());
+        _nextRemix = new LevelRemix<K,V>(*_remix);
+        if (_activeRun == 0){
+            _nextRemix->rebuild(after, (unsigned) after.size());
+            return;
+        }
+        for (unsigned i = _activeRun; i < after.size(); i++){
+            _nextRemix->addRun(after, i);
+        }
+    }
+
+    // 在磁盘写锁外面建好最老的m个run被合并走以后的有序视图，见prepareRemixAdd
+    void prepareRemixDrop(unsigned m){
+        if (!_remix){
+            return;
+        }
+        clearRemixes();
+        vector<DiskRun<K,V> *> after(runs.begin() + m, runs.begin() + _activeRun);
+        _nextRemix = new LevelRemix<K,V>(*_remix);
+        _nextRemix->dropOldest(after, m);
+    }
+
+    // run[first, _activeRun)刚装上：提前建好了视图就换上，没有的话在这里把它们加进去
+    void installRemix(unsigned first){
+        if (_nextRemix){
+            swapRemix();
+            return;
+        }
+        for (unsigned i = first; _remix && i < _activeRun; i++){
+            _remix->addRun(runs, i);
+        }
+    }
+
+    void swapRemix(){
+        delete _oldRemix;
+        _oldRemix = _remix;
+        _remix = _nextRemix;
+        _nextRemix = nullptr;
+    }
+
+    void clearRemixes(){
+        delete _nextRemix;
+        delete _oldRemix;
+        _nextRemix = nullptr;
+        _oldRemix = nullptr;
+    }
+
+    // run的[from, to)位置上的key加进整层的过滤器，记成第i个run；每IO_CHUNK个key拿一次磁盘写锁，不会长时间挡住查找
+    // run还没生效时i是它要装上的位置：查找看到比已有的run都新的编号，只是多问几个run的布隆过滤器
+    void filterKeys(DiskRun<K,V> *run, int i, unsigned long from, unsigned long to){
+        while (_filter && from < to){
+            unsigned long end = min(to, from + IO_CHUNK);
+            if (_lock){
+                pthread_rwlock_wrlock(_lock);
+            }
+            addKeys(run, i, from, end);
+            if (_lock){
+                pthread_rwlock_unlock(_lock);
             }
-            runs[i]->_filename = newName;
+            from = end;
         }
+    }
 
-        // ok，因为删除了几个run，所以添加几个新run
-        for (int i = _activeRun; i < _numRuns; i++){
-            DiskRun<K, V> * newRun = new DiskRun<K,V>(_runSize, _pageSize, _level, i, _bf_fp);
-            runs.push_back(newRun);
+    void addKeys(DiskRun<K,V> *run, int i, unsigned long from, unsigned long to){
+        for (unsigned long j = from; j < to; j++){
+            _filter->add(run->map[j].key, i);
         }
     }
 
-    // 该层是不是满了
+    // 该层是不是满了：再放不下一个合并写出来的run，或者run的个数到了上限
+    // 没有挪下来的run时就是_numRuns个位置都用完了
     bool levelFull(){
-        return (_activeRun == _numRuns);
+        return _activeRun >= _maxRuns || _used + _runSize > (unsigned long) _numRuns * _runSize;
     }
 
     // 该层是不是空的
@@ -253,15 +769,27 @@ public: // TODO make some of these private
     }
 
     // 在runs里面找key对应的value
-    V lookup (const K &key, bool &found) {
-        int maxRunToSearch = levelFull() ? _numRuns - 1 : _activeRun - 1;
+    // 被范围删除覆盖的key当作找到了墓碑返回
+    // hint顺着各层往下传，见DiskRun::Hint
+    V lookup (const K &key, bool &found, uint64_t asOf = UINT64_MAX, typename DiskRun<K,V>::Hint *hint = nullptr) {
+        int maxRunToSearch = _activeRun - 1;
+        // 比newest新的run里肯定没有这个key，只看它们的范围删除；newest本身不用再过布隆过滤器
+        int newest = _filter ? _filter->newestRun(key) : maxRunToSearch;
         for (int i = maxRunToSearch; i >= 0; --i){
-            if (runs[i]->maxKey == INT_MIN || key < runs[i]->minKey || key > runs[i]->maxKey || !runs[i]->bf.mayContain(&key, sizeof(K))){
-                continue;
+            if (i <= newest && !(runs[i]->maxKey == INT_MIN || key < runs[i]->minKey || key > runs[i]->maxKey || (i < newest && !runs[i]->bf.mayContain(&key, sizeof(K))))){
+                uint64_t seq;
+                V lookupRes = runs[i]->lookup(key, found, seq, asOf, hint);
+                if (found) {
+                    return runs[i]->tombstones.hides(key, seq, asOf) ? V_TOMBSTONE : lookupRes;
+                }
+            }
+            else if (hint && runs[i]->_capacity && (key < runs[i]->minKey || key > runs[i]->maxKey)){
+                // 不在范围里的run不用查也知道key落在第一页或者最后一页，链不断
+                runs[i]->passHint(key < runs[i]->minKey ? 0 : runs[i]->_iMaxFP, hint);
             }
-            V lookupRes = runs[i]->lookup(key, found);
-            if (found) {
-                return lookupRes;
+            if (runs[i]->tombstones.covers(key, asOf)){
+                found = true;
+                return V_TOMBSTONE;
             }
         }
         
@@ -25,7 +25,10 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <atomic>
 #include "run.hpp"
+#include "rangeTombstone.hpp"
+#include "rangeFilter.hpp"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -35,17 +38,97 @@
 #include <sys/mman.h>
 #include <cassert>
 #include <algorithm>
+#include <climits>
 
 
 using namespace std;
 
 template <class K, class V> class DiskLevel;
 
+#define RUN_FILE_MAGIC 0x326e75726d736c73ULL // "slsmrun2"
+
+// 外部生成的run文件：count个DiskPair，接着numFences个fence pointer，最后是这个footer
+// DiskPair按内存布局写（见run.hpp），只有key和value；导入时所有KV用同一个新序号。
+// 每个KV带8字节seq的旧格式（"slsmrun1"）readFooter会拒掉
+template <class K>
+struct RunFileFooter {
+    uint64_t magic;
+    uint64_t count;
+    uint64_t pageSize;  // 每个fence pointer管多少个KV
+    uint64_t numFences;
+    K minKey;
+    K maxKey;
+};
+
 template <class K, class V>
 class DiskRun {
     friend class DiskLevel<K,V>;
 public:
     typedef KVPair<K,V> KVPair_t;
+    typedef DiskPair<K,V> DiskPair_t;
+
+    // 分散层叠（fractional cascading）：所有非空的run按查找的顺序串起来（同一层从新到老，再到下一层最新的run），
+    // 每个run的第p页记着它的首key在下一个run里落在第几页（_bridges[p]）。上一个run查到key在第p页的话，
+    // 下一个run只要在_bridges[p]到_bridges[p + 1]这几页里找，不用在整个fence数组上二分
+    // Hint记着上一个查过的run和key在它的第几页，顺着链查的时候传下去；中间跳过了run的话退回整个二分
+    struct Hint {
+        const DiskRun *run = nullptr;
+        unsigned page = 0;
+    };
+
+    // 磁盘run上的游标，和跳表的游标接口一样，直接读mmap
+    class Cursor : public RunCursor<K,V> {
+    public:
+        // 几个游标按查找顺序一个接一个seek时共用一个hint
+        Cursor(DiskRun *run, Hint *hint = nullptr): _run(run), _pos(run->_capacity), _hint(hint) {}
+
+        void seek(const K &key){
+            if (_run->_capacity == 0){
+                _pos = 0;
+            }
+            else if (key > _run->maxKey){
+                _pos = _run->_capacity;
+                _run->passHint(_run->_iMaxFP, _hint);
+            }
+            else if (key <= _run->minKey){
+                _pos = 0;
+                _run->passHint(0, _hint);
+            }
+            else {
+                bool found = false;
+                _pos = _run->first_index(key, found, _hint);
+            }
+        }
+
+        void seekToFirst(){
+            _pos = 0;
+        }
+
+        bool valid(){
+            return _pos < _run->_capacity;
+        }
+
+        void next(){
+            ++_pos;
+        }
+
+        K key(){
+            return _run->map[_pos].key;
+        }
+
+        V value(){
+            return _run->map[_pos].value;
+        }
+
+        uint64_t seq(){
+            return _run->seqAt(_pos);
+        }
+
+    private:
+        DiskRun *_run;
+        unsigned long _pos;
+        Hint *_hint;
+    };
 
     // const void*表示指针指向的地址可以变，但是指向地址的内容只读不可写；保护变量
     // 这里a和b应该会是KVPair<K,V>*类型
@@ -57,20 +140,23 @@ public:
         return 10;
     }
 
-    KVPair_t *map;          // 硬盘映射到内存
+    DiskPair_t *map;        // 硬盘映射到内存
     int fd;                 // 文件标识符
     unsigned int pageSize;  // 页面大小
     BloomFilter<K> bf;      // 布隆过滤器
+    RangeFilter<K> rangeFilter; // 范围过滤器，短范围落在key的空隙里时不用二分；导入的外部run没有
+    TombstoneSet<K> tombstones; // 范围删除标记，覆盖比这个run更老的数据，和本run里序号更小的版本（合并时为快照留下的）
+    uint64_t globalSeq = 0;     // 没有留每个KV的序号时，run里所有KV共用的写入序号
     
     K minKey = INT_MIN;
     K maxKey = INT_MIN;
 
     // 构造函数
     DiskRun<K,V> (unsigned long capacity, unsigned int pageSize, int level, int runID, double bf_fp):_capacity(capacity),_level(level), _iMaxFP(0), pageSize(pageSize), _runID(runID), _bf_fp(bf_fp), bf(capacity, bf_fp) {
-        
+        _stamp = nextStamp();
         _filename = "C_" + to_string(level) + "_" + to_string(runID) + ".txt";
         
-        size_t filesize = capacity * sizeof(KVPair_t);
+        size_t filesize = capacity * sizeof(DiskPair_t);
 
         long result;
 
@@ -106,17 +192,18 @@ public:
         // mmap将文件map到内存，是的内存中的字节与文件中的字节一一对应
         // addr一般设为0，是建议地址；len文件长度；prot表明对这块内存的保护方式，不可与文件访问方式冲突；flags描述映射的类型，MAP_SHARED表示和其他进程共享这个文件，往内存中写入相当于往文件中写入；
         // fd文件描述符，offset文件偏移，从文件起始算起
-        map = (KVPair<K, V>*) mmap(0, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        map = (DiskPair_t *) mmap(0, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (map == MAP_FAILED) {
             close(fd);
             perror("Error mmapping the file");
             exit(EXIT_FAILURE);
         }
+        _mappedSize = filesize;
     }
 
     // 析构函数
     ~DiskRun<K,V>(){
-        fsync(fd); // 同步内存中所有已修改的文件数据到储存设备
+        // no fsync: the file is removed right below, so flushing its pages is wasted I/O (and a stall for whoever frees the run)
         doUnmap();
 
         // remove()删除给定的文件名
@@ -129,6 +216,150 @@ public:
         }
     }
 
+    // 导入外部run文件：文件已经是引擎的run格式，直接映射进来，fence pointer从footer里读，不拷贝也不重写数据
+    // 文件名是C_level_runID.txt，由调用者硬链接好；析构时只删掉这个链接
+    DiskRun<K,V> (DiskPair_t *mapped, int mappedFd, size_t mappedSize, const RunFileFooter<K> &footer, const vector<K> &fences, const BloomFilter<K> &filter, int level, int runID, double bf_fp):_capacity(footer.count),_level(level), _iMaxFP((unsigned) fences.size() - 1), pageSize((unsigned) footer.pageSize), _runID(runID), _bf_fp(bf_fp), bf(filter) {
+        _filename = "C_" + to_string(level) + "_" + to_string(runID) + ".txt";
+        map = mapped;
+        fd = mappedFd;
+        _mappedSize = mappedSize;
+        _fencePointers = fences;
+        _stamp = nextStamp();
+        minKey = footer.minKey;
+        maxKey = footer.maxKey;
+    }
+
+    // 批处理作业用：把有序的KV写成可以用ingest_file导入的run文件
+    static bool writeRunFile(const string &path, const KVPair_t *data, unsigned long n, unsigned pageSize){
+        if (n == 0 || pageSize == 0){
+            return false;
+        }
+        FILE *out = fopen(path.c_str(), "wb");
+        if (!out){
+            perror(("Error opening file " + path).c_str());
+            return false;
+        }
+        vector<K> fences;
+        for (unsigned long j = 0; j < n; j += pageSize){
+            fences.push_back(data[j].key);
+        }
+        RunFileFooter<K> footer = {RUN_FILE_MAGIC, n, pageSize, fences.size(), data[0].key, data[n - 1].key};
+        bool ok = true;
+        for (unsigned long j = 0; ok && j < n; j++){
+            DiskPair_t p = DiskPair_t();
+            p.key = data[j].key;
+            p.value = data[j].value;
+            ok = fwrite(&p, sizeof(p), 1, out) == 1;
+        }
+        ok = ok && fwrite(fences.data(), sizeof(K), fences.size(), out) == fences.size()
+            && fwrite(&footer, sizeof(footer), 1, out) == 1;
+        ok = fclose(out) == 0 && ok;
+        return ok;
+    }
+
+    // 只读footer，导入前用来拿key的范围；格式不对返回false
+    static bool readFooter(const string &path, RunFileFooter<K> &footer){
+        int f = open(path.c_str(), O_RDONLY);
+        if (f == -1){
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(f, &st) == 0 && st.st_size >= (off_t) sizeof(footer)
+            && pread(f, &footer, sizeof(footer), st.st_size - sizeof(footer)) == sizeof(footer);
+        close(f);
+        return ok && footer.magic == RUN_FILE_MAGIC && footer.count > 0 && footer.pageSize > 0
+            && footer.numFences == (footer.count + footer.pageSize - 1) / footer.pageSize
+            && (uint64_t) st.st_size == footer.count * sizeof(DiskPair_t) + footer.numFences * sizeof(K) + sizeof(footer);
+    }
+
+    // 打开并校验外部run文件（key有序、footer和fence pointer跟数据对得上），顺便建布隆过滤器，
+    // 然后硬链接成本层的run文件名；文件不对返回nullptr，不会留下任何东西
+    static DiskRun<K,V> * openRunFile(const string &path, int level, int runID, double bf_fp){
+        RunFileFooter<K> footer;
+        if (!readFooter(path, footer)){
+            return nullptr;
+        }
+        int f = open(path.c_str(), O_RDONLY);
+        if (f == -1){
+            return nullptr;
+        }
+        size_t filesize = footer.count * sizeof(DiskPair_t) + footer.numFences * sizeof(K) + sizeof(footer);
+        void *m = mmap(0, filesize, PROT_READ, MAP_SHARED, f, 0);
+        if (m == MAP_FAILED){
+            close(f);
+            return nullptr;
+        }
+        DiskPair_t *data = (DiskPair_t *) m;
+        const K *fp = (const K *) (data + footer.count);
+        vector<K> fences(fp, fp + footer.numFences);
+        BloomFilter<K> filter(footer.count, bf_fp);
+        bool ok = data[0].key == footer.minKey && data[footer.count - 1].key == footer.maxKey;
+        for (unsigned long j = 0; ok && j < footer.count; j++){
+            if ((j > 0 && data[j].key < data[j - 1].key) || (j % footer.pageSize == 0 && !(fences[j / footer.pageSize] == data[j].key))){
+                ok = false;
+            }
+            filter.add(&data[j].key, sizeof(K));
+        }
+        string name = "C_" + to_string(level) + "_" + to_string(runID) + ".txt";
+        if (!ok || link(path.c_str(), name.c_str()) != 0){
+            if (ok){
+                perror(("Error linking file " + path + " to " + name).c_str());
+            }
+            munmap(m, filesize);
+            close(f);
+            return nullptr;
+        }
+        return new DiskRun<K,V>(data, f, filesize, footer, fences, filter, level, runID, bf_fp);
+    }
+
+    // 第i个KV的写入序号
+    // 文件里不存序号，run里的KV共用globalSeq（写进来的KV里最大的序号）。这样不会弄错新老：
+    // 查找顺序上更新的run里的序号都比这个run里的大，更老的都比它小；同一个run里一个key只有一个版本，
+    // 被本run的范围删除盖住的版本合并时已经丢掉了。只有写run时有快照落在这些KV的序号中间，
+    // 同一个key要留几个版本给快照看时，才在_seqs里留下每个KV自己的序号
+    uint64_t seqAt(unsigned long i){
+        return _seqs.empty() ? globalSeq : _seqs[i];
+    }
+
+    // 第i个KV，序号是生效的那个
+    KVPair_t entry(unsigned long i){
+        KVPair_t kv = {map[i].key, map[i].value, seqAt(i)};
+        return kv;
+    }
+
+    // run里KV生效的最小、最大序号，决定合并出来的run要不要留每个KV的序号；空run是[UINT64_MAX, 0]
+    uint64_t minSeq(){
+        return _seqs.empty() ? (_capacity ? globalSeq : UINT64_MAX) : _minSeq;
+    }
+
+    uint64_t maxSeq(){
+        return _seqs.empty() ? (_capacity ? globalSeq : 0) : _maxSeq;
+    }
+
+    // 开始往这个run里写：keepSeqs为true时留下每个KV的序号，否则只记最大的那个
+    void beginWrite(bool keepSeqs){
+        _seqs.clear();
+        if (keepSeqs){
+            _seqs.resize(_mappedSize / sizeof(DiskPair_t));
+        }
+        globalSeq = 0;
+        _minSeq = UINT64_MAX;
+        _maxSeq = 0;
+    }
+
+    // 把kv写到第i个位置
+    void put(unsigned long i, const KVPair_t &kv){
+        map[i].key = kv.key;
+        map[i].value = kv.value;
+        if (_seqs.empty()){
+            globalSeq = max(globalSeq, kv.seq);
+            return;
+        }
+        _seqs[i] = kv.seq;
+        _minSeq = min(_minSeq, kv.seq);
+        _maxSeq = max(_maxSeq, kv.seq);
+    }
+
     // 设置容量
     void setCapacity(unsigned long newCap){
         _capacity = newCap;
@@ -141,9 +372,9 @@ public:
 
     // 写数据
     void writeData(const KVPair_t *run, const size_t offset, const unsigned long len) {
-        // void *memcpy(void *str1, const void *str2, size_t n)从存储区str2复制n个字节到存储区str1，返回一个指向目标存储区str1的指针
-        // str1指向用于存储复制内容的目标数组，类型强制转换为void*指针；str2指向要复制的数据源；n是要被复制的字节数
-        memcpy(map + offset, run, len * sizeof(KVPair_t));
+        for (unsigned long i = 0; i < len; i++){
+            put(offset + i, run[i]);
+        }
         _capacity = len;
 
     }
@@ -153,24 +384,47 @@ public:
     // fencePointer存着run映射到内存中的每个页的首元素的key
     void constructIndex(){
         // construct fence pointers and write BF
+        beginIndex(RangeFilter<K>::count(_capacity, [this](unsigned long j){ return map[j].key; }));
+        for (unsigned long j = 0; j < _capacity; j++) {
+            indexEntry(j);
+        }
+        endIndex();
+    }
+
+    // 增量建立索引：增量合并时每写定一个位置就调用一次indexEntry，避免合并结束时再扫一遍整个run
+    // filterEntries是预计范围过滤器有多少个块，见RangeFilter::begin
+    void beginIndex(size_t filterEntries){
         // _fencePointers.resize(0);
         // reserve() 为容器预留足够的空间，避免不必要的重复分配。预留空间大于等于字符串的长度。
-        _fencePointers.reserve(_capacity / pageSize);
+        _fencePointers.reserve(_capacity / pageSize + 1);
         _iMaxFP = -1; // TODO IS THIS SAFE?
-        for (int j = 0; j < _capacity; j++) {
-            bf.add((K*) &map[j].key, sizeof(K));
-            if (j % pageSize == 0){
-                _fencePointers.push_back(map[j].key);
-                _iMaxFP++;
-            }
+        rangeFilter.begin(filterEntries);
+    }
+
+    void indexEntry(unsigned long j){
+        bf.add((K*) &map[j].key, sizeof(K));
+        rangeFilter.add(map[j].key);
+        if (j % pageSize == 0){
+            _fencePointers.push_back(map[j].key);
+            _iMaxFP++;
         }
+    }
 
+    void endIndex(){
         // resize()是设置size大小。size()是分配容器的内存大小，而capacity()只是设置容器容量大小，但并没有真正分配内存。
         if (_iMaxFP >= 0){
             _fencePointers.resize(_iMaxFP + 1);
         }
+        // 内容变了，之前连到这个run上的bridge都作废
+        _stamp = nextStamp();
 
         // 最大key和最小key，这也说明run是有序的，从小到大排列
+        // a run can be empty when it only carries range tombstones
+        if (_capacity == 0){
+            minKey = INT_MAX;
+            maxKey = INT_MIN;
+            return;
+        }
         minKey = map[0].key;
         maxKey = map[_capacity - 1].key;
         
@@ -248,32 +502,90 @@ public:
         }
     }
 
-    // 找到key的具体位置
-    unsigned long get_index(const K &key, bool &found){
+    // [lo, hi]页里最后一个首key不大于key的页，都大于key时是lo
+    unsigned find_page(const K &key, unsigned lo, unsigned hi) const {
+        while (lo < hi){
+            unsigned middle = (lo + hi + 1) >> 1;
+            if (_fencePointers[middle] <= key){
+                lo = middle;
+            }
+            else {
+                hi = middle - 1;
+            }
+        }
+        return lo;
+    }
+
+    // 找到key的具体位置；hint是上一个run的话只在它指过来的几页里找，然后把hint改成这个run
+    unsigned long get_index(const K &key, bool &found, Hint *hint = nullptr){
         unsigned long start, end;
-        // 找到在第几页，然后用二分查找找到具体位置
-        get_flanking_FP(key, start, end);
+        if (hint && hint->run && hint->run->_cascade == this && hint->run->_cascadeStamp == _stamp){
+            const vector<unsigned> &bridges = hint->run->_bridges;
+            unsigned p = hint->page;
+            unsigned lo = p == 0 ? 0 : bridges[p];
+            unsigned hi = p + 1 < bridges.size() ? bridges[p + 1] : _iMaxFP;
+            start = (unsigned long) find_page(key, lo, hi) * pageSize;
+            end = min(start + pageSize, _capacity);
+        }
+        else {
+            // 找到在第几页，然后用二分查找找到具体位置
+            get_flanking_FP(key, start, end);
+        }
+        passHint((unsigned) (start / pageSize), hint);
         unsigned long ret = binary_search(start, end - start, key, found);
         return ret;
     }
 
-    // 查找key是否存在
-    V lookup(const K &key, bool &found){
-         unsigned long idx = get_index(key, found);
-         V ret = map[idx].value;
-         return found ? ret : (V) NULL;
+    // 同一个key可能有多个版本（从新到老挨着放），还可能跨过页的边界，所以往前找到第一个
+    unsigned long first_index(const K &key, bool &found, Hint *hint = nullptr){
+        unsigned long idx = get_index(key, found, hint);
+        if (found){
+            while (idx > 0 && map[idx - 1].key == key){
+                --idx;
+            }
+        }
+        return idx;
+    }
+
+    // 查找key是否存在；有asOf时找序号不大于asOf的最新版本，seq是它的序号
+    V lookup(const K &key, bool &found, uint64_t &seq, uint64_t asOf = UINT64_MAX, Hint *hint = nullptr){
+        unsigned long idx = first_index(key, found, hint);
+        if (!found){
+            return (V) NULL;
+        }
+        for (; idx < _capacity && map[idx].key == key; ++idx){
+            seq = seqAt(idx);
+            if (seq <= asOf){
+                return map[idx].value;
+            }
+        }
+        found = false;
+        return (V) NULL;
      }
 
+    // 和这个run合并出来的run的范围过滤器最多有多少个块，没有范围过滤器时按最坏的情况算
+    size_t filterEntries(){
+        return rangeFilter.entries() ? rangeFilter.entries() : RangeFilter<K>::maxEntries(_capacity);
+    }
+
+    // [key1, key2)里可能有key：先看最小最大key，再问范围过滤器
+    bool mayOverlap(const K &key1, const K &key2){
+        if (_capacity == 0 || key2 <= key1 || key1 > maxKey || key2 <= minKey){
+            return false;
+        }
+        return rangeFilter.mayContain(max(key1, minKey), min((K) (key2 - 1), maxKey));
+    }
+
      // 范围查询，查找key1~key2的索引范围
     void range(const K &key1, const K &key2, unsigned long &i1, unsigned long &i2){
         i1 = 0;
         i2 = 0;
-        if (key1 > maxKey || key2 < minKey){
+        if (key1 > maxKey || key2 < minKey || !mayOverlap(key1, key2)){
             return;
         }
         if (key1 >= minKey){
             bool found = false;
-            i1 = get_index(key1, found);
+            i1 = first_index(key1, found);
             
         }
         if (key2 > maxKey){
@@ -282,7 +594,41 @@ public:
         }
         else {
             bool found = false;
-            i2 = get_index(key2, found);
+            i2 = first_index(key2, found);
+        }
+    }
+
+    RunCursor<K,V> * cursor(Hint *hint = nullptr){
+        return new Cursor(this, hint);
+    }
+
+    // key落在这个run的第page页：查找顺序上的下一个run可以接着用
+    void passHint(unsigned page, Hint *hint) const {
+        if (hint){
+            hint->run = this;
+            hint->page = page;
+        }
+    }
+
+    // 把查找顺序上的下一个非空run设成next（没有就是nullptr），顺着两边的fence数组走一遍建bridge
+    // 链没变、next的内容也没变时什么都不做。调用时持有磁盘写锁
+    void linkCascade(const DiskRun *next){
+        if (next == _cascade && (!next || next->_stamp == _cascadeStamp)){
+            return;
+        }
+        _cascade = next;
+        _bridges.clear();
+        if (!next){
+            return;
+        }
+        _cascadeStamp = next->_stamp;
+        _bridges.resize(_iMaxFP + 1);
+        unsigned t = 0;
+        for (unsigned p = 0; p <= _iMaxFP; ++p){
+            while (t < next->_iMaxFP && next->_fencePointers[t + 1] <= _fencePointers[p]){
+                ++t;
+            }
+            _bridges[p] = t;
         }
     }
 
@@ -302,10 +648,23 @@ private:
     unsigned _iMaxFP;         // 最大FencePointer
     unsigned _runID;          // run的id
     double _bf_fp;            // 布隆过滤器的false positive
+    size_t _mappedSize;       // mmap的长度；_capacity会随合并结果变小，解除映射要用原来的长度
+    vector<uint64_t> _seqs;   // 每个KV自己的序号，只在快照要区分run里的版本时才有（见seqAt），不落盘
+    uint64_t _minSeq = UINT64_MAX;
+    uint64_t _maxSeq = 0;
+    uint64_t _stamp;          // 索引每建一次换一个，别的run连过来时记下它，用来判断bridge是否还有效
+    const DiskRun *_cascade = nullptr; // 查找顺序上的下一个非空run
+    uint64_t _cascadeStamp = 0;        // 建bridge时_cascade的_stamp
+    vector<unsigned> _bridges;         // 每页首key在_cascade里的页号
+
+    static uint64_t nextStamp(){
+        static atomic<uint64_t> next(0);
+        return ++next;
+    }
                             
     void doMap(){
         
-        size_t filesize = _capacity * sizeof(KVPair_t);
+        size_t filesize = _capacity * sizeof(DiskPair_t);
         
         fd = open(_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, (mode_t) 0600);
         if (fd == -1) {
@@ -314,19 +673,18 @@ private:
         }
         
         
-        map = (KVPair<K, V>*) mmap(0, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        map = (DiskPair_t *) mmap(0, filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (map == MAP_FAILED) {
             close(fd);
             perror("Error mmapping the file");
             exit(EXIT_FAILURE);
         }
+        _mappedSize = filesize;
     }
     
     void doUnmap(){
-        size_t filesize = _capacity * sizeof(KVPair_t);
-
         // munmap()用来取消参数start所指的映射内存起始地址,参数length则是欲取消的内存大小
-        if (munmap(map, filesize) == -1) {
+        if (munmap(map, _mappedSize) == -1) {
             perror("Error un-mmapping the file");
         }
         
@@ -338,7 +696,7 @@ private:
     void doubleSize(){
         unsigned long new_capacity = _capacity * 2;
         
-        size_t new_filesize = new_capacity * sizeof(KVPair_t);
+        size_t new_filesize = new_capacity * sizeof(DiskPair_t);
         int result = lseek(fd, new_filesize - 1, SEEK_SET);
         if (result == -1) {
             close(fd);
@@ -353,12 +711,13 @@ private:
             exit(EXIT_FAILURE);
         }
         
-        map = (KVPair<K, V>*) mmap(0, new_filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        map = (DiskPair_t *) mmap(0, new_filesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (map == MAP_FAILED) {
             close(fd);
             perror("Error mmapping the file");
             exit(EXIT_FAILURE);
         }
+        _mappedSize = new_filesize;
         
         _capacity = new_capacity;
     }
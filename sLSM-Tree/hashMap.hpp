@@ -20,124 +20,214 @@
 //        You should have received a copy of the GNU General Public License
 //        along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
-#include "MurmurHash.h"
-#include <stdlib.h>
 #include <cstdint>
-#include <climits>
+#include <cstring>
+#include <vector>
+#include "run.hpp"
+#include "keyHash.hpp"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifndef hashMap_h
 #define hashMap_h
 
+using namespace std;
 
+// SwissTable式的开放寻址哈希表：每个位置一个控制字节，空位、删掉的位置，或者key哈希的低7位
+// 一次取16个控制字节（一组），用SSE2一条比较找出低7位对得上的位置，只有这些位置才去比key；组里有空位就说明key不在表里
+// 容量是2的幂，组之间按三角数跳着探测；key的任何取值都能存，删除只把控制字节标成已删除
 template <typename K, typename V>
 class HashTable {
 public:
-    unsigned long _size;
-    unsigned long _elts;
-    KVPair<K,V> EMPTY = {INT_MIN, INT_MIN};
-    
-    HashTable(unsigned long size): _size(2 * size), _elts(0) {
-        table = new KVPair<K, V> [_size]();
-        fill(table + 0, table + _size, (KVPair<K,V>) EMPTY);
+    // size是预计的元素个数，超过了会自己扩容
+    HashTable(unsigned long size): _elts(0) {
+        size_t cap = GROUP;
+        while (cap * 7 / 8 < size){
+            cap <<= 1;
+        }
+        init(cap);
     }
-    
-    ~HashTable() {
-//        for (int i = 0; i < _size; i++) {
-//            delete table[i];
-//        }
-        delete [] table;
+
+    bool get(const K &key, V &value) const {
+        size_t i;
+        if (!find(key, KeyHash<K>::hash64(key), i)){
+            return false;
+        }
+        value = _slots[i].value;
+        return true;
     }
-    
-    void resize(){
-        _size *= 2;
-        auto newTable = new KVPair<K,V> [_size]();
-        fill(newTable + 0, newTable + _size, (KVPair<K,V>) EMPTY);
-
-        for (unsigned long i = 0; i < _size / 2; i++){
-            if (table[i] != EMPTY){
-                unsigned long newHash = hashFunc(table[i].key);
-                
-                for (int j = 0;; j++){
-                    if (newTable[(newHash + j) % _size] == EMPTY){
-                        newTable[(newHash + j) % _size] = table[i];
-                        break;
-                    }
-                }
 
-            }
+    void put(const K &key, const V &value) {
+        size_t i = slotFor(key);
+        _slots[i].value = value;
+    }
+
+    // key不在表里时插入并返回(V) NULL；已经在的话不改，返回原来的value
+    V putIfEmpty(const K &key, const V &value) {
+        size_t before = _elts;
+        size_t i = slotFor(key);
+        if (_elts == before){
+            return _slots[i].value;
         }
-        delete [] table;
-        
-        table = newTable;
+        _slots[i].value = value;
+        return (V) NULL;
     }
-    
-    bool get(const K &key, V &value) {
-        unsigned long hashValue = hashFunc(key);
-        for (int i = 0;; ++i){
-            if (table[(hashValue + i) % _size] == EMPTY){
-                return false;
+
+    bool erase(const K &key) {
+        size_t i;
+        if (!find(key, KeyHash<K>::hash64(key), i)){
+            return false;
+        }
+        setCtrl(i, DELETED);
+        --_elts;
+        return true;
+    }
+
+    unsigned long size() const {
+        return _elts;
+    }
+
+private:
+    static const size_t GROUP = 16;
+    static const int8_t EMPTY = -128;  // 从来没用过，探测到有空位的组就停
+    static const int8_t DELETED = -2;  // 删掉了，查找时跳过，插入时可以复用
+                                       // 有元素的位置是0到127
+
+    // 一组控制字节里符合条件的位置，第i位对应组里第i个
+    struct Group {
+#if defined(__SSE2__)
+        __m128i ctrl;
+        explicit Group(const int8_t *p): ctrl(_mm_loadu_si128((const __m128i *) p)) {}
+        uint32_t match(int8_t h2) const {
+            return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+        }
+        uint32_t matchEmpty() const {
+            return match(EMPTY);
+        }
+        // 空位和删掉的位置的最高位都是1
+        uint32_t matchFree() const {
+            return (uint32_t) _mm_movemask_epi8(ctrl);
+        }
+#else
+        int8_t ctrl[GROUP];
+        explicit Group(const int8_t *p) {
+            memcpy(ctrl, p, GROUP);
+        }
+        uint32_t match(int8_t h2) const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < GROUP; ++i){
+                m |= (uint32_t) (ctrl[i] == h2) << i;
             }
-            else if (table[(hashValue + i) % _size].key == key){
-                value = table[(hashValue + i) % _size].value;
-                return true;
+            return m;
+        }
+        uint32_t matchEmpty() const {
+            return match(EMPTY);
+        }
+        uint32_t matchFree() const {
+            uint32_t m = 0;
+            for (size_t i = 0; i < GROUP; ++i){
+                m |= (uint32_t) (ctrl[i] < 0) << i;
             }
+            return m;
         }
+#endif
+    };
 
-        return false;
+    static int8_t h2Of(uint64_t h){
+        return (int8_t) (h & 0x7f);
     }
-    
-    void put(const K &key, const V &value) {
-        if (_elts * 2 > _size){
-            resize();
-        }
-        unsigned long hashValue = hashFunc(key);
-        KVPair<K, V> node;
-        
-        for (unsigned long i = 0;; i++){
-            if (table[(hashValue + i) % _size] == EMPTY){
-                table[(hashValue + i) % _size].key = key;
-                table[(hashValue + i) % _size].value = value;
-                ++_elts;
-                return;
+
+    void init(size_t cap){
+        _mask = cap - 1;
+        // 后面多放一组，是前GROUP个控制字节的副本，从最后几个位置开始取一组时不用绕回来
+        _ctrl.assign(cap + GROUP, (int8_t) EMPTY);
+        _slots.assign(cap, KVPair<K,V>());
+        _growthLeft = cap * 7 / 8;
+    }
+
+    void setCtrl(size_t i, int8_t c){
+        _ctrl[i] = c;
+        if (i < GROUP){
+            _ctrl[_mask + 1 + i] = c;
+        }
+    }
+
+    bool find(const K &key, uint64_t h, size_t &slot) const {
+        int8_t h2 = h2Of(h);
+        size_t pos = (h >> 7) & _mask;
+        for (size_t step = GROUP;; pos = (pos + step) & _mask, step += GROUP){
+            Group g(&_ctrl[pos]);
+            for (uint32_t m = g.match(h2); m; m &= m - 1){
+                size_t i = (pos + __builtin_ctz(m)) & _mask;
+                if (_slots[i].key == key){
+                    slot = i;
+                    return true;
+                }
             }
-            else if (table[(hashValue + i) % _size].key == key){
-                
-                table[(hashValue + i) % _size].value = value;
-                return;
+            if (g.matchEmpty()){
+                return false;
             }
         }
     }
-    
-    V putIfEmpty(const K &key, const V &value) {
-        if (_elts * 2 > _size){
-            resize();
-        }
-        unsigned long hashValue = hashFunc(key);
-        
-        for (unsigned long i = 0;; i++){
-            if (table[(hashValue + i) % _size] == EMPTY){
-                table[(hashValue + i) % _size].key = key;
-                table[(hashValue + i) % _size].value = value;
-                ++_elts;
-                return (V) NULL;
-            }
-            else if (table[(hashValue + i) % _size].key == key){
-                // something already here, return current occupant to user
-                return table[(hashValue + i) % _size].value;
+
+    // 第一个能放新元素的位置（空位或者删掉的）
+    size_t freeSlot(uint64_t h) const {
+        size_t pos = (h >> 7) & _mask;
+        for (size_t step = GROUP;; pos = (pos + step) & _mask, step += GROUP){
+            uint32_t m = Group(&_ctrl[pos]).matchFree();
+            if (m){
+                return (pos + __builtin_ctz(m)) & _mask;
             }
         }
     }
-    
-    
-    unsigned long hashFunc(const K key){
-        array<unsigned long, 2> hashValue;
-        
-        MurmurHash3_x64_128(&key, sizeof(K), 0, hashValue.data());
-        return  (hashValue[0] % _size);
+
+    // key所在的位置，不在的话先放进去（value还没写）
+    size_t slotFor(const K &key){
+        uint64_t h = KeyHash<K>::hash64(key);
+        size_t i;
+        if (find(key, h, i)){
+            return i;
+        }
+        i = freeSlot(h);
+        if (_ctrl[i] == EMPTY && _growthLeft == 0){
+            rehash();
+            i = freeSlot(h);
+        }
+        _growthLeft -= _ctrl[i] == EMPTY;
+        setCtrl(i, h2Of(h));
+        _slots[i].key = key;
+        ++_elts;
+        return i;
     }
-    
-private:
-    KVPair<K, V> *table;
+
+    // 没空位了：删掉的位置很多就原样重排把它们清掉，否则容量翻倍
+    void rehash(){
+        size_t cap = _mask + 1;
+        if (_elts >= cap * 7 / 16){
+            cap <<= 1;
+        }
+        vector<int8_t> oldCtrl;
+        vector<KVPair<K,V>> oldSlots;
+        oldCtrl.swap(_ctrl);
+        oldSlots.swap(_slots);
+        init(cap);
+        for (size_t i = 0; i < oldSlots.size(); ++i){
+            if (oldCtrl[i] >= 0){
+                uint64_t h = KeyHash<K>::hash64(oldSlots[i].key);
+                size_t j = freeSlot(h);
+                setCtrl(j, h2Of(h));
+                _slots[j] = oldSlots[i];
+                --_growthLeft;
+            }
+        }
+    }
+
+    vector<int8_t> _ctrl;          // 每个位置的控制字节，后面多GROUP个
+    vector<KVPair<K,V>> _slots;
+    size_t _mask;                  // 容量减一
+    size_t _elts;                  // 元素个数
+    size_t _growthLeft;            // 还能用掉几个空位；装到7/8满就重排
 };
 
 #endif /* hashMap_h */
@@ -0,0 +1,73 @@
+//
+//  keyHash.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef keyHash_h
+#define keyHash_h
+
+#include <cstdint>
+#include <array>
+#include <functional>
+#include <type_traits>
+#include "MurmurHash.h"
+
+using namespace std;
+
+// splitmix64的finalizer：两轮乘法加xorshift，64位全部雪崩
+inline uint64_t mix64(uint64_t x){
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// key的哈希，编译期按key的类型选实现
+// 不超过8个字节的整数key：直接在寄存器里混，hash128的两半用两个不同的输入混出来，互相独立
+// 别的key：hash128按字节走Murmur3，hash64在std::hash上再混一遍
+template <class K, bool Integral = is_integral<K>::value && sizeof(K) <= sizeof(uint64_t)>
+struct KeyHash {
+    static array<uint64_t, 2> hash128(const K &key){
+        array<uint64_t, 2> h;
+        MurmurHash3_x64_128(&key, (int) sizeof(K), 0, h.data());
+        return h;
+    }
+
+    static uint64_t hash64(const K &key){
+        return mix64(hash<K>()(key));
+    }
+};
+
+template <class K>
+struct KeyHash<K, true> {
+    static array<uint64_t, 2> hash128(const K &key){
+        uint64_t x = (uint64_t) key;
+        array<uint64_t, 2> h = {{mix64(x), mix64(x ^ 0x9e3779b97f4a7c15ULL)}};
+        return h;
+    }
+
+    static uint64_t hash64(const K &key){
+        return mix64((uint64_t) key);
+    }
+};
+
+#endif /* keyHash_h */
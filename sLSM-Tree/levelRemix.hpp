@@ -0,0 +1,199 @@
+//
+//  levelRemix.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef levelRemix_h
+#define levelRemix_h
+
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include <utility>
+#include <functional>
+#include <algorithm>
+#include "run.hpp"
+#include "diskRun.hpp"
+
+using namespace std;
+
+// 一层所有run合起来的有序视图（REMIX）：不拷贝数据，只记全局有序的第p个KV在哪个run里（_sel[p]，一个字节）
+// 每SEGMENT个位置记一个锚点：这个位置的key和此时每个run读到了哪里
+// seek在锚点上二分一次，再顺着_sel往后走不到一段；之后next只是按_sel推进对应run的下标，不用堆
+// 同一个key新的run排在前面，run里面本来就是新版本在前，所以一个key的第一个可见版本就是最新的
+// 视图本身不管范围删除，run带着范围删除标记的层不要用它
+template <class K, class V>
+class LevelRemix {
+public:
+    static const unsigned MAX_RUNS = 256;
+
+    // 顺着视图读一层的游标；runs是这一层的run数组，持有磁盘读锁期间不会变
+    class Cursor : public RunCursor<K,V> {
+    public:
+        Cursor(const LevelRemix *remix, const vector<DiskRun<K,V> *> *runs): _remix(remix), _runs(runs), _pos(remix->_sel.size()), _off(remix->_n, 0) {}
+
+        void seek(const K &key){
+            const vector<K> &anchors = _remix->_anchorKeys;
+            if (anchors.empty()){
+                _pos = 0;
+                return;
+            }
+            // 最后一个首key小于key的段
+            size_t s = lower_bound(anchors.begin(), anchors.end(), key) - anchors.begin();
+            s = s ? s - 1 : 0;
+            _pos = s * SEGMENT;
+            copy(_remix->_anchorOffs.begin() + s * _remix->_n, _remix->_anchorOffs.begin() + (s + 1) * _remix->_n, _off.begin());
+            while (valid() && this->key() < key){
+                next();
+            }
+        }
+
+        void seekToFirst(){
+            _pos = 0;
+            fill(_off.begin(), _off.end(), 0);
+        }
+
+        bool valid(){
+            return _pos < _remix->_sel.size();
+        }
+
+        void next(){
+            ++_off[_remix->_sel[_pos++]];
+        }
+
+        K key(){
+            unsigned r = _remix->_sel[_pos];
+            return (*_runs)[r]->map[_off[r]].key;
+        }
+
+        V value(){
+            unsigned r = _remix->_sel[_pos];
+            return (*_runs)[r]->map[_off[r]].value;
+        }
+
+        uint64_t seq(){
+            unsigned r = _remix->_sel[_pos];
+            return (*_runs)[r]->seqAt(_off[r]);
+        }
+
+    private:
+        const LevelRemix *_remix;
+        const vector<DiskRun<K,V> *> *_runs;
+        unsigned long _pos;
+        vector<unsigned long> _off; // 每个run读到了哪里
+    };
+
+    LevelRemix(): _n(0) {}
+
+    // 用前n个run从头建：多路归并一遍
+    void rebuild(const vector<DiskRun<K,V> *> &runs, unsigned n){
+        _n = n;
+        _sel.clear();
+        // (key, -run)：同一个key新的run先出来
+        typedef pair<K, int> Head;
+        priority_queue<Head, vector<Head>, greater<Head>> heap;
+        vector<unsigned long> off(n, 0);
+        unsigned long total = 0;
+        for (unsigned r = 0; r < n; ++r){
+            total += runs[r]->getCapacity();
+            if (runs[r]->getCapacity()){
+                heap.push(make_pair(runs[r]->map[0].key, -(int) r));
+            }
+        }
+        _sel.reserve(total);
+        while (!heap.empty()){
+            unsigned r = (unsigned) -heap.top().second;
+            heap.pop();
+            _sel.push_back((uint8_t) r);
+            if (++off[r] < runs[r]->getCapacity()){
+                heap.push(make_pair(runs[r]->map[off[r]].key, -(int) r));
+            }
+        }
+        buildAnchors(runs);
+    }
+
+    // runs[n]刚生效，比视图里已有的n个run都新：和现有的顺序两路归并
+    void addRun(const vector<DiskRun<K,V> *> &runs, unsigned n){
+        assert(n == _n && n < MAX_RUNS);
+        DiskRun<K,V> *run = runs[n];
+        unsigned long cap = run->getCapacity();
+        vector<uint8_t> sel;
+        sel.reserve(_sel.size() + cap);
+        vector<unsigned long> off(n, 0);
+        unsigned long j = 0;
+        for (size_t p = 0; p < _sel.size(); ++p){
+            unsigned r = _sel[p];
+            const K &key = runs[r]->map[off[r]].key;
+            while (j < cap && run->map[j].key <= key){
+                sel.push_back((uint8_t) n);
+                ++j;
+            }
+            sel.push_back((uint8_t) r);
+            ++off[r];
+        }
+        sel.insert(sel.end(), cap - j, (uint8_t) n);
+        _sel.swap(sel);
+        _n = n + 1;
+        buildAnchors(runs);
+    }
+
+    // 最老的m个run被合并走了，剩下的往前挪m个：只要把它们的位置去掉，不用比较key
+    void dropOldest(const vector<DiskRun<K,V> *> &runs, unsigned m){
+        size_t w = 0;
+        for (size_t p = 0; p < _sel.size(); ++p){
+            if (_sel[p] >= m){
+                _sel[w++] = (uint8_t) (_sel[p] - m);
+            }
+        }
+        _sel.resize(w);
+        _n = _n > m ? _n - m : 0;
+        buildAnchors(runs);
+    }
+
+    RunCursor<K,V> * cursor(const vector<DiskRun<K,V> *> *runs) const {
+        return new Cursor(this, runs);
+    }
+
+private:
+    static const unsigned SEGMENT = 32;
+
+    void buildAnchors(const vector<DiskRun<K,V> *> &runs){
+        size_t segs = (_sel.size() + SEGMENT - 1) / SEGMENT;
+        _anchorKeys.resize(segs);
+        _anchorOffs.resize(segs * _n);
+        vector<unsigned long> off(_n, 0);
+        for (size_t p = 0; p < _sel.size(); ++p){
+            unsigned r = _sel[p];
+            if (p % SEGMENT == 0){
+                size_t s = p / SEGMENT;
+                _anchorKeys[s] = runs[r]->map[off[r]].key;
+                copy(off.begin(), off.end(), _anchorOffs.begin() + s * _n);
+            }
+            ++off[r];
+        }
+    }
+
+    unsigned _n;                      // 视图里有几个run（这一层的前_n个）
+    vector<uint8_t> _sel;             // 全局有序的第p个KV在哪个run里
+    vector<K> _anchorKeys;            // 每段第一个KV的key
+    vector<unsigned long> _anchorOffs; // 每段开头时每个run的下标，第s段是[s * _n, (s + 1) * _n)
+};
+
+#endif /* levelRemix_h */
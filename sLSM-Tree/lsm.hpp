@@ -28,8 +28,16 @@
 
 #include "run.hpp"
 #include "skipList.hpp"
+#include "artRun.hpp"
 #include "bloom.hpp"
 #include "diskLevel.hpp"
+#include "writeController.hpp"
+#include "mergeIterator.hpp"
+#include "rowCache.hpp"
+#include "snapshot.hpp"
+#include "writeBatch.hpp"
+#include "bufferIndex.hpp"
+#include "bufferFilter.hpp"
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
@@ -38,34 +46,104 @@
 #include <vector>
 #include <mutex>
 #include <thread>
+#include <deque>
+#include <memory>
+#include <condition_variable>
+#include <pthread.h>
+#include <atomic>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-template <class K, class V>
+#define PARALLEL_RANGE_MIN (1 << 16) // 估计结果少于这么多个KV时并行不划算
+#define RANGE_PARTS_PER_THREAD 4     // 每个线程分几段，段多一些负载更均衡
+#define BULK_SORT_MEMORY (1 << 24)   // 批量导入时一次在内存里排序多少个KV，输入更大时走外排序
+#define BULK_READ_PAIRS 4096         // 退回逐个插入时每次读多少个KV
+
+// RunType是memory buffer里run的类型，默认是跳表；整数key可以换成ARTRun<K,V>
+// 要继承Run<K,V>，构造函数是RunType(minKey, maxKey)
+template <class K, class V, class RunType = SkipList<K,V>>
 class LSM {
-    
-    typedef SkipList<K,V> RunType; // 表示run类型是跳表
 
 public:
+    // 刷盘前被封存的一批跳表：不再接受写入，但在刷到磁盘之前仍然能被lookup和range看到
+    struct SealedBuffer {
+        vector<Run<K,V> *> runs;          // 从老到新
+        vector<BloomFilter<K> *> filters;
+        vector<TombstoneSet<K>> tombstones; // 每个跳表上的范围删除
+        unsigned long elts;
+        bool bySeq = false; // 多写线程的各个分片一起封存的：跳表之间没有先后，同一个key按写入序号取最新的
+
+        ~SealedBuffer(){
+            for (int i = 0; i < runs.size(); ++i){
+                delete runs[i];
+                delete filters[i];
+            }
+        }
+    };
+    typedef shared_ptr<SealedBuffer> SealedPtr;
+
     V V_TOMBSTONE = (V) TOMBSTONE;  // 删除标记
-    mutex *mergeLock;               // 互斥锁
+    mutex *mergeLock;               // 互斥锁，同一时间只有一个线程改动磁盘层级
+    pthread_rwlock_t *diskLock;     // 读写锁：查找持读锁，合并结果生效（run可见/释放/新建层）时持写锁
     
     vector<Run<K,V> *> C_0; // memory的buffer
     
     vector<BloomFilter<K> *> filters;    // 布隆过滤器
+    vector<TombstoneSet<K>> rangeTombstones; // 和C_0一一对应的范围删除标记
     vector<DiskLevel<K,V> *> diskLevels; // 硬盘层级
 
+    deque<SealedPtr> sealed;             // 等待刷盘的缓冲区，越靠后越新
+    mutex *sealedLock;                   // 保护sealed和下面的刷盘状态
+    condition_variable *flushCV;         // 有新的缓冲区可以刷，或者轮到某个刷盘线程提交
+    condition_variable *spaceCV;         // 有缓冲区刷完了，等待的写线程可以继续
+    vector<thread> flushWorkers;         // 刷盘线程池
+    WriteController *writeController;    // 合并跟不上时给写入限流
+    RateLimiter *ioLimiter;              // 刷盘和合并的I/O限速，为空表示不限速
+    RowCache<K,V> *rowCache;             // 磁盘层前面的热点key缓存，为空表示不缓存
+    BufferIndex<K,V> *bufferIndex;       // C_0的哈希索引，查C_0只要一次探测；为空表示不用
+    BufferFilter<K> *bufferFilter;       // 整个C_0共用的过滤器，查一次就知道从哪个跳表开始找
+
+    // 多写线程模式：每个写线程写自己分片里的跳表，互不竞争；全局写入序号决定同一个key的新旧
+    // 任何时候所有分片一起封存，所以一批封存里的序号都比后面的批次小，批次之间还是按封存顺序决定新旧
+    struct WriteShard {
+        mutex lock;
+        RunType *run;
+        BloomFilter<K> *filter;
+    };
+    vector<WriteShard *> writeShards;    // 为空表示单写线程模式，写入走C_0
+    mutex *freezeLock;                   // 保证分片封存的顺序和进入刷盘队列的顺序一致
+    mutex *shardTombLock;                // 保护shardTombstones
+    TombstoneSet<K> shardTombstones;     // 分片上的范围删除，盖住分片里和已经封存的数据中序号更小的版本
+    atomic<uint64_t> *_seq;              // 全局写入序号
+    mutex *batchLock;                    // 单写线程模式下一批写入期间持有，取快照也要拿它，快照看不到写了一半的批
+    atomic<unsigned long> *_shardElts;   // 分片里一共写了多少个KV，到一个第0层run的大小就封存
+    SnapshotList *snapshots;             // 还活着的快照，决定被覆盖的旧版本要不要留
+
     // 这两个默认构造函数有什么区别？
-    LSM<K,V>(const LSM<K,V> &other) = default;
-    LSM<K,V>(LSM<K,V> &&other) = default;
+    LSM(const LSM &other) = default;
+    LSM(LSM &&other) = default;
 
     // 构造函数：构造层级+C_0里面的skiplist+bf
-    LSM<K,V>(unsigned long eltsPerRun, unsigned int numRuns, double merged_frac, double bf_fp, unsigned int pageSize, unsigned int diskRunsPerLevel): _eltsPerRun(eltsPerRun), _num_runs(numRuns), _frac_runs_merged(merged_frac), _diskRunsPerLevel(diskRunsPerLevel), _num_to_merge(ceil(_frac_runs_merged * _num_runs)), _pageSize(pageSize){
+    LSM(unsigned long eltsPerRun, unsigned int numRuns, double merged_frac, double bf_fp, unsigned int pageSize, unsigned int diskRunsPerLevel): _eltsPerRun(eltsPerRun), _num_runs(numRuns), _frac_runs_merged(merged_frac), _diskRunsPerLevel(diskRunsPerLevel), _num_to_merge(ceil(_frac_runs_merged * _num_runs)), _pageSize(pageSize){
         _activeRun = 0;
         _bfFalsePositiveRate = bf_fp;
         _n = 0;
+        _mergeBudget = 0;
+        _levelFilter = false;
+        _levelRemix = false;
+        _sealedElts = 0;
+        _maxSealedElts = 2 * _num_to_merge * _eltsPerRun;
+        _nextToClaim = 0;
+        _nextToCommit = 0;
+        _stopFlush = false;
+
+        diskLock = new pthread_rwlock_t;
+        pthread_rwlock_init(diskLock, NULL);
 
         // pageSize, level, runSize, numRuns, mergeSize, bf_fp
         // 构造磁盘层级，先构造一层
-        DiskLevel<K,V> * diskLevel = new DiskLevel<K, V>(pageSize, 1, _num_to_merge * _eltsPerRun, _diskRunsPerLevel, ceil(_diskRunsPerLevel * _frac_runs_merged), _bfFalsePositiveRate);
+        DiskLevel<K,V> * diskLevel = new DiskLevel<K, V>(pageSize, 1, _num_to_merge * _eltsPerRun, _diskRunsPerLevel, ceil(_diskRunsPerLevel * _frac_runs_merged), _bfFalsePositiveRate, diskLock);
         diskLevels.push_back(diskLevel);
         _numDiskLevels = 1;
 
@@ -83,17 +161,53 @@ public:
             // 设置bf加入到filters里面
             BloomFilter<K> * bf = new BloomFilter<K>(_eltsPerRun, _bfFalsePositiveRate);
             filters.push_back(bf);
+            rangeTombstones.push_back(TombstoneSet<K>());
         }
 
         mergeLock = new mutex();
+        sealedLock = new mutex();
+        flushCV = new condition_variable();
+        spaceCV = new condition_variable();
+        writeController = new WriteController();
+        ioLimiter = nullptr;
+        rowCache = nullptr;
+        bufferIndex = nullptr;
+        bufferFilter = new BufferFilter<K>((size_t) _num_runs * _eltsPerRun);
+        freezeLock = new mutex();
+        shardTombLock = new mutex();
+        _seq = new atomic<uint64_t>(0);
+        batchLock = new mutex();
+        _shardElts = new atomic<unsigned long>(0);
+        snapshots = new SnapshotList();
+        startFlushWorkers(1);
     }
 
     // 析构函数
-    ~LSM<K,V>(){
-        if (mergeThread.joinable()){
-            mergeThread.join();
-        }
+    ~LSM(){
+        stopFlushWorkers();
+        sealed.clear();
         delete mergeLock;
+        pthread_rwlock_destroy(diskLock);
+        delete diskLock;
+        delete sealedLock;
+        delete flushCV;
+        delete spaceCV;
+        delete writeController;
+        delete ioLimiter;
+        delete rowCache;
+        delete bufferIndex;
+        delete bufferFilter;
+        for (int i = 0; i < writeShards.size(); ++i){
+            delete writeShards[i]->run;
+            delete writeShards[i]->filter;
+            delete writeShards[i];
+        }
+        delete freezeLock;
+        delete shardTombLock;
+        delete _seq;
+        delete batchLock;
+        delete _shardElts;
+        delete snapshots;
         for (int i = 0; i < C_0.size(); ++i){
             delete C_0[i];
             delete filters[i];
@@ -106,6 +220,19 @@ public:
 
     // 插入key
     void insert_key(K &key, V &value) {
+        throttleWrite();
+
+        if (!writeShards.empty()){
+            insertSharded(key, value);
+            if (rowCache){
+                rowCache->erase(key);
+            }
+            if (_mergeBudget != 0){
+                stepMerges();
+            }
+            return;
+        }
+
         // 如果当前_activeRun指向的跳表满了，加一，指向下一个跳表
         // _activeRun初值为0
         if (C_0[_activeRun]->num_elements() >= _eltsPerRun){
@@ -118,38 +245,164 @@ public:
         }
 
         // 给C_0和filters插入元素
-        C_0[_activeRun]->insert_key(key,value);
+        uint64_t seq = ++*_seq;
+        C_0[_activeRun]->insert_key(key, value, seq, snapshots->newest());
         filters[_activeRun]->add(&key, sizeof(K));
+        bufferFilter->add(key, _activeRun);
+        if (bufferIndex){
+            bufferIndex->put(key, value, seq, _activeRun);
+        }
+        if (rowCache){
+            rowCache->erase(key);
+        }
+
+        if (_mergeBudget != 0){
+            stepMerges();
+        }
     }
 
     // 查找key
     bool lookup(K &key, V &value){
+        return lookupAsOf(key, value, UINT64_MAX);
+    }
+
+    // 在快照上查找key：只看序号不大于快照的写入
+    bool lookup(K &key, V &value, const Snapshot *snap){
+        return lookupAsOf(key, value, snap->seq);
+    }
+
+    // 拿一个快照，之后的写入对它不可见；用完要release_snapshot，否则被覆盖的旧版本一直留着
+    // 范围删除也有序号，快照之后的范围删除对它不可见
+    const Snapshot * snapshot(){
+        lock_guard<mutex> lk(*batchLock);
+        return snapshots->acquire(*_seq);
+    }
+
+    void release_snapshot(const Snapshot *snap){
+        snapshots->release(snap);
+    }
+
+    bool lookupAsOf(K &key, V &value, uint64_t asOf){
         bool found = false;
+        // 缓存里是最新的版本，快照读不走缓存
+        // 版本号要在查C_0之前读：查的过程中有写入的话版本号变了，磁盘上查到的旧值就放不进缓存
+        bool useCache = rowCache && asOf == UINT64_MAX;
+        uint64_t cacheVersion = useCache ? rowCache->version(key) : 0;
+        // 多写线程模式下先查所有分片，取序号最大的版本
+        if (!writeShards.empty()){
+            uint64_t best = 0;
+            for (int i = 0; i < writeShards.size(); ++i){
+                WriteShard &ws = *writeShards[i];
+                lock_guard<mutex> lk(ws.lock);
+                if (!ws.filter->mayContain(&key, sizeof(K))){
+                    continue;
+                }
+                bool f = false;
+                uint64_t seq = 0;
+                V v = ws.run->lookup(key, f, seq, asOf);
+                if (f && (!found || seq > best)){
+                    found = true;
+                    best = seq;
+                    value = v;
+                }
+            }
+            lock_guard<mutex> lk(*shardTombLock);
+            if (found){
+                return value != V_TOMBSTONE && !shardTombstones.hides(key, best, asOf);
+            }
+            if (shardTombstones.covers(key, asOf)){
+                return false;
+            }
+        }
+        // 有哈希索引的话一次探测就知道key在C_0里的最新版本；快照要看更老的版本时还是一个一个跳表找
+        bool scanC0 = true;
+        if (bufferIndex){
+            uint64_t seq;
+            unsigned run;
+            if (bufferIndex->get(key, value, seq, run)){
+                if (seq <= asOf){
+                    // 更新的跳表或者它所在的跳表上更晚的范围删除盖住了它
+                    for (int i = _activeRun; i >= (int) run; --i){
+                        if (rangeTombstones[i].hides(key, seq, asOf)){
+                            return false;
+                        }
+                    }
+                    return value != V_TOMBSTONE;
+                }
+            }
+            else {
+                // 不在C_0里，只需要看C_0上的范围删除
+                scanC0 = false;
+            }
+        }
+        // 比newest新的跳表里肯定没有这个key，只看它们的范围删除；newest本身不用再过布隆过滤器
+        int newest = scanC0 ? bufferFilter->newestRun(key) : -1;
         // 从新跳表往老跳表查找
         for (int i = _activeRun; i >= 0; --i){
             // 小于最小or大于最大or不是BF中可能存在
-            if (key < C_0[i]->get_min() || key > C_0[i]->get_max() || !filters[i]->mayContain(&key, sizeof(K)))
+            if (i <= newest && !(key < C_0[i]->get_min() || key > C_0[i]->get_max() || (i < newest && !filters[i]->mayContain(&key, sizeof(K))))){
+                // 如果在min和max之间而且BF认为可能存在，则在跳表中查找
+                uint64_t seq;
+                value = C_0[i]->lookup(key, found, seq, asOf);
+                // 如果找到了，判断是否为墓碑、是否被同一个跳表上更晚的范围删除盖住，都不是就找到了
+                if (found) {
+                    return value != V_TOMBSTONE && !rangeTombstones[i].hides(key, seq, asOf);
+                }
+            }
+            // 被这个跳表上的范围删除覆盖，更老的版本都不算数
+            if (rangeTombstones[i].covers(key, asOf)){
+                return false;
+            }
+        }
+        // 再找还没刷到磁盘的封存缓冲区，从新到老
+        vector<SealedPtr> pending = sealedSnapshot();
+        for (int s = (int) pending.size() - 1; s >= 0; --s){
+            SealedBuffer &buf = *pending[s];
+            if (buf.bySeq){
+                if (lookupBySeq(buf, key, value, found, asOf)){
+                    return value != V_TOMBSTONE;
+                }
+                if (found){
+                    return false; // 被范围删除覆盖
+                }
                 continue;
-            // 如果在min和max之间而且BF认为可能存在，则在跳表中查找
-            value = C_0[i]->lookup(key, found);
-            // 如果找到了，判断是否为墓碑，不是墓碑就找到了
-            if (found) {
-                return value != V_TOMBSTONE;
+            }
+            for (int i = (int) buf.runs.size() - 1; i >= 0; --i){
+                if (!(key < buf.runs[i]->get_min() || key > buf.runs[i]->get_max() || !buf.filters[i]->mayContain(&key, sizeof(K)))){
+                    uint64_t seq;
+                    value = buf.runs[i]->lookup(key, found, seq, asOf);
+                    if (found) {
+                        return value != V_TOMBSTONE && !buf.tombstones[i].hides(key, seq, asOf);
+                    }
+                }
+                if (buf.tombstones[i].covers(key, asOf)){
+                    return false;
+                }
             }
         }
-        if (mergeThread.joinable()){
-            // make sure that there isn't a merge happening as you search the disk
-            mergeThread.join();
+        // 内存里都没有，热点key直接从缓存拿，不用读磁盘
+        if (useCache && rowCache->get(key, value)){
+            return value != V_TOMBSTONE;
         }
         // it's not in C_0 so let's look at disk.如果不在C_0，扫描所有的disk_level
+        // the read lock keeps a finishing merge from swapping runs out from under us
+        pthread_rwlock_rdlock(diskLock);
+        typename DiskRun<K,V>::Hint hint;
         for (int i = 0; i < _numDiskLevels; i++){
             
-            value = diskLevels[i]->lookup(key, found);
+            value = diskLevels[i]->lookup(key, found, asOf, &hint);
             if (found) {
-                return value != V_TOMBSTONE;
+                break;
             }
         }
-        return false;
+        pthread_rwlock_unlock(diskLock);
+        if (!found){
+            value = V_TOMBSTONE;
+        }
+        if (useCache){
+            rowCache->put(key, value, cacheVersion);
+        }
+        return value != V_TOMBSTONE;
     }
 
     // 删除key
@@ -158,60 +411,596 @@ public:
         insert_key(key, V_TOMBSTONE);
     }
 
-    // 范围查询
+    // 删除[key1, key2)里的所有key
+    // 在当前跳表上记一个带新序号的范围删除标记，它盖住更老的跳表和当前跳表里序号更小的版本，跳表里的节点不动，
+    // 快照还能看到旧版本；被盖住的KV在刷盘和合并时丢掉，合并时被整个覆盖的run不用读
+    void delete_range(K &key1, K &key2){
+        if (key2 <= key1){
+            return;
+        }
+        throttleWrite();
+        if (!writeShards.empty()){
+            deleteRangeSharded(key1, key2);
+            return;
+        }
+        rangeTombstones[_activeRun].add(key1, key2, ++*_seq);
+        if (rowCache){
+            rowCache->eraseRange(key1, key2);
+        }
+    }
+
+    // 一次写入一批：排好序以后顺着插进跳表（finger search），布隆过滤器一次算完整批的哈希，满没满、要不要刷盘也只按批检查
+    // 整批共用一个写入序号，对快照是原子的：批写到一半时取不到快照，之后取的快照看得到整批
+    // 单写线程模式下C_0放不下整批时先封存，批中间不会刷盘；比整个C_0还大的批只能边写边封存，部分先进封存缓冲区
+    // 多写线程模式下一批不超过一个第0层run时，并发的读要么看到整批要么一条都看不到
+    void write(WriteBatch<K,V> &batch){
+        if (batch.empty()){
+            return;
+        }
+        throttleWrite();
+        const vector<typename WriteBatch<K,V>::Op> &ops = batch.sorted();
+        vector<KVPair<K,V>> kvs(ops.size());
+        vector<K> keys(ops.size());
+        for (unsigned long i = 0; i < ops.size(); i++){
+            KVPair<K,V> kv = {ops[i].key, ops[i].del ? V_TOMBSTONE : ops[i].value, 0};
+            kvs[i] = kv;
+            keys[i] = ops[i].key;
+        }
+        if (!writeShards.empty()){
+            writeShardedBatch(kvs, keys);
+        }
+        else {
+            lock_guard<mutex> lk(*batchLock);
+            unsigned long capacity = (unsigned long) _num_runs * _eltsPerRun;
+            while (kvs.size() <= capacity && C_0[0]->num_elements() != 0 && freeSlots() < kvs.size()){
+                sealRuns(min(_num_to_merge, _activeRun + 1));
+            }
+            uint64_t seq = ++*_seq;
+            unsigned long done = 0;
+            while (done < kvs.size()){
+                if (C_0[_activeRun]->num_elements() >= _eltsPerRun){
+                    ++_activeRun;
+                }
+                if (_activeRun >= _num_runs){
+                    do_merge();
+                }
+                unsigned long n = min((unsigned long) kvs.size() - done, (unsigned long) (_eltsPerRun - C_0[_activeRun]->num_elements()));
+                C_0[_activeRun]->insert_batch(&kvs[done], n, seq, snapshots->newest());
+                filters[_activeRun]->addBatch(&keys[done], n);
+                for (unsigned long i = done; i < done + n; i++){
+                    bufferFilter->add(keys[i], _activeRun);
+                }
+                for (unsigned long i = done; bufferIndex && i < done + n; i++){
+                    bufferIndex->put(kvs[i].key, kvs[i].value, seq, _activeRun);
+                }
+                done += n;
+            }
+        }
+        if (rowCache){
+            for (unsigned long i = 0; i < keys.size(); i++){
+                rowCache->erase(keys[i]);
+            }
+        }
+        if (_mergeBudget != 0){
+            stepMerges();
+        }
+    }
+
+    // C_0里还能写多少个KV
+    unsigned long freeSlots(){
+        return (_eltsPerRun - C_0[_activeRun]->num_elements()) + (unsigned long) (_num_runs - 1 - _activeRun) * _eltsPerRun;
+    }
+
+    // 范围查询[key1, key2)，结果按key排好序
     vector<KVPair<K,V>> range(K &key1, K &key2){
+        return rangeAsOf(key1, key2, UINT64_MAX);
+    }
+
+    // 在快照上做范围查询
+    vector<KVPair<K,V>> range(K &key1, K &key2, const Snapshot *snap){
+        return rangeAsOf(key1, key2, snap->seq);
+    }
+
+    vector<KVPair<K,V>> rangeAsOf(const K &key1, const K &key2, uint64_t asOf){
         if (key2 <= key1){
             return (vector<KVPair<K,V>> {});
         }
-        auto ht = HashTable<K, V>(4096 * 1000);
-        
         vector<KVPair<K,V>> eltsInRange = vector<KVPair<K,V>>();
+        MergeIterator<K,V> *it = newIterator(key2, asOf);
+        for (it->seek(key1); it->valid(); it->next()){
+            eltsInRange.push_back(it->current());
+        }
+        delete it;
+        return eltsInRange;
+    }
 
-        for (int i = _activeRun; i >= 0; --i){
-            vector<KVPair<K,V>> cur_elts = C_0[i]->get_all_in_range(key1, key2);
-            if (cur_elts.size() != 0){
-                eltsInRange.reserve(eltsInRange.size() + cur_elts.size()); //this over-reserves to be safe
-                for (int c = 0; c < cur_elts.size(); c++){
-                    V dummy = ht.putIfEmpty(cur_elts[c].key, cur_elts[c].value);
-                    if (!dummy && cur_elts[c].value != V_TOMBSTONE){
-                        eltsInRange.push_back(cur_elts[c]);
-                    }
-                    
+    // 所有数据上的有序迭代器，只遍历小于upper的key；用完要delete
+    // 持有迭代器时不要在同一个线程里写入：它拿着磁盘的读锁，刷盘会等它
+    // asOf给出时只看序号不大于它的写入
+    MergeIterator<K,V> * newIterator(const K &upper = INT_MAX, uint64_t asOf = UINT64_MAX){
+        MergeIterator<K,V> *it = new MergeIterator<K,V>(diskLock, upper, asOf);
+        addSources(it);
+        return it;
+    }
+
+    // 并行范围查询[key1, key2)：按key把范围切成若干段，每段一个迭代器，各自做新版本优先的多路归并
+    // 段之间key不重叠，按顺序拼起来就是range的结果；大run也会被切开由多个线程一起扫
+    vector<KVPair<K,V>> parallel_range(K &key1, K &key2){
+        if (key2 <= key1){
+            return (vector<KVPair<K,V>> {});
+        }
+        int threads = 1;
+#ifdef _OPENMP
+        threads = omp_get_max_threads();
+#endif
+        pthread_rwlock_rdlock(diskLock);
+        vector<K> bounds = rangeSplits(key1, key2, threads * RANGE_PARTS_PER_THREAD);
+        int parts = (int) bounds.size() - 1;
+        if (threads == 1 || parts < 2){
+            pthread_rwlock_unlock(diskLock);
+            return range(key1, key2);
+        }
+        // 迭代器都在这里建好，共用外面这一把读锁
+        vector<MergeIterator<K,V> *> its(parts);
+        for (int p = 0; p < parts; p++){
+            its[p] = new MergeIterator<K,V>(nullptr, bounds[p + 1]);
+            addSources(its[p]);
+        }
+        vector<vector<KVPair<K,V>>> out(parts);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int p = 0; p < parts; p++){
+            for (its[p]->seek(bounds[p]); its[p]->valid(); its[p]->next()){
+                out[p].push_back(its[p]->current());
+            }
+            delete its[p];
+        }
+        pthread_rwlock_unlock(diskLock);
+
+        vector<unsigned long> offsets(parts + 1, 0);
+        for (int p = 0; p < parts; p++){
+            offsets[p + 1] = offsets[p] + out[p].size();
+        }
+        vector<KVPair<K,V>> eltsInRange(offsets[parts]);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int p = 0; p < parts; p++){
+            copy(out[p].begin(), out[p].end(), eltsInRange.begin() + offsets[p]);
+            vector<KVPair<K,V>>().swap(out[p]);
+        }
+        return eltsInRange;
+    }
+
+    // 给迭代器加上所有的输入，从新到老
+    void addSources(MergeIterator<K,V> *it){
+        // 分片还在被别的线程写，拷一份快照给迭代器
+        if (!writeShards.empty()){
+            vector<shared_ptr<RunType>> snaps;
+            for (int i = 0; i < writeShards.size(); ++i){
+                shared_ptr<RunType> snap(new RunType(INT32_MIN, INT32_MAX));
+                lock_guard<mutex> lk(writeShards[i]->lock);
+                RunCursor<K,V> *c = writeShards[i]->run->cursor();
+                for (c->seekToFirst(); c->valid(); c->next()){
+                    snap->insert_key(c->key(), c->value(), c->seq(), UINT64_MAX);
                 }
+                delete c;
+                snaps.push_back(snap);
+            }
+            // 同一批里范围删除不覆盖彼此，所以全挂在最后一个分片上就行
+            shared_ptr<TombstoneSet<K>> none(new TombstoneSet<K>()), ts;
+            {
+                lock_guard<mutex> lk(*shardTombLock);
+                ts.reset(new TombstoneSet<K>(shardTombstones));
+            }
+            it->pin(none);
+            it->pin(ts);
+            for (int i = 0; i < snaps.size(); ++i){
+                it->pin(snaps[i]);
+                it->addRun(snaps[i].get(), i + 1 == snaps.size() ? *ts : *none, i > 0);
             }
-            
         }
-        
-        if (mergeThread.joinable()){
-            // make sure that there isn't a merge happening as you search the disk
-            mergeThread.join();
+        for (int i = _activeRun; i >= 0; --i){
+            it->addRun(C_0[i], rangeTombstones[i]);
+        }
+        vector<SealedPtr> pending = sealedSnapshot();
+        for (int s = (int) pending.size() - 1; s >= 0; --s){
+            it->pin(pending[s]);
+            for (int i = (int) pending[s]->runs.size() - 1; i >= 0; --i){
+                it->addRun(pending[s]->runs[i], pending[s]->tombstones[i], pending[s]->bySeq && i + 1 < pending[s]->runs.size());
+            }
         }
-        
         for (int j = 0; j < _numDiskLevels; j++){
+            if (diskLevels[j]->remixUsable()){
+                it->addDiskLevel(diskLevels[j]);
+                continue;
+            }
             for (int r = diskLevels[j]->_activeRun - 1; r >= 0 ; --r){
+                it->addDiskRun(diskLevels[j]->runs[r]);
+            }
+        }
+    }
+
+    // 把[key1, key2)按数据量切成最多parts段，返回段的边界（包括key1和key2）
+    // 在磁盘run落在范围里的部分上等间隔取样，run越大取的样越多；数据太少时不切，只返回两端
+    // 调用时持有磁盘读锁
+    vector<K> rangeSplits(const K &key1, const K &key2, int parts){
+        vector<K> bounds(1, key1);
+        unsigned long total = 0;
+        vector<pair<unsigned long, unsigned long>> spans;
+        vector<DiskRun<K,V> *> spanRuns;
+        for (int j = 0; j < _numDiskLevels; j++){
+            for (int r = 0; r < diskLevels[j]->_activeRun; ++r){
                 unsigned long i1, i2;
                 diskLevels[j]->runs[r]->range(key1, key2, i1, i2);
-                if (i2 - i1 != 0){
-                    auto oldSize = eltsInRange.size();
-                    eltsInRange.reserve(oldSize + (i2 - i1)); // also over-reserves space
-                    for (unsigned long m = i1; m < i2; ++m){
-                        auto KV = diskLevels[j]->runs[r]->map[m];
-                        V dummy = ht.putIfEmpty(KV.key, KV.value);
-                        if (!dummy && KV.value != V_TOMBSTONE) {
-                            eltsInRange.push_back(KV);
-                        }
+                if (i2 > i1){
+                    spans.push_back(make_pair(i1, i2));
+                    spanRuns.push_back(diskLevels[j]->runs[r]);
+                    total += i2 - i1;
+                }
+            }
+        }
+        if (parts > 1 && total >= PARALLEL_RANGE_MIN){
+            unsigned long step = total / (parts * 8) + 1;
+            vector<K> samples;
+            for (int i = 0; i < spans.size(); i++){
+                for (unsigned long m = spans[i].first; m < spans[i].second; m += step){
+                    samples.push_back(spanRuns[i]->map[m].key);
+                }
+            }
+            sort(samples.begin(), samples.end());
+            for (int p = 1; p < parts; p++){
+                K b = samples[samples.size() * p / parts];
+                if (bounds.back() < b && b < key2){
+                    bounds.push_back(b);
+                }
+            }
+        }
+        bounds.push_back(key2);
+        return bounds;
+    }
+
+    // 批量导入文件里的KV：文件里是一个接一个的(K, V)，同一个key后出现的算新的，值是墓碑的当作删除
+    // 按key排好序以后直接写成最深一层上key互不重叠的run，不经过跳表、刷盘和逐层合并
+    // 输入放不进BULK_SORT_MEMORY时分块排序写临时文件，再多路归并（外排序）；分块排序和run的索引都是并行建的
+    // 只能导入空树；已经有数据时退回到逐个insert_key
+    // 文件读不了、临时文件写不了时返回false：树里没有导入任何数据（退回逐个插入时，出错前读到的KV已经插进去了），临时文件都删掉
+    bool bulk_load(const string &filename){
+        FILE *in = fopen(filename.c_str(), "rb");
+        if (!in){
+            perror(("Error opening file " + filename).c_str());
+            return false;
+        }
+        const size_t pairBytes = sizeof(K) + sizeof(V);
+        fseek(in, 0, SEEK_END);
+        unsigned long n = ftell(in) / pairBytes;
+        rewind(in);
+
+        if (!isEmpty()){
+            vector<char> buf(BULK_READ_PAIRS * pairBytes);
+            size_t got;
+            while ((got = fread(buf.data(), pairBytes, BULK_READ_PAIRS, in)) > 0){
+                for (size_t i = 0; i < got; i++){
+                    K k;
+                    V v;
+                    memcpy(&k, &buf[i * pairBytes], sizeof(K));
+                    memcpy(&v, &buf[i * pairBytes + sizeof(K)], sizeof(V));
+                    insert_key(k, v);
+                }
+            }
+            bool ok = !ferror(in);
+            if (!ok){
+                perror(("Error reading file " + filename).c_str());
+            }
+            fclose(in);
+            return ok;
+        }
+
+        // 第一步：分块读进来并行排序；一块就是全部输入时留在内存里，否则写成临时文件
+        int threads = 1;
+#ifdef _OPENMP
+        threads = omp_get_max_threads();
+#endif
+        vector<vector<KVPair<K,V>>> pieces;   // 留在内存里的有序块
+        vector<FILE *> spills;                // 写到临时文件的有序块，见spillFile
+        vector<pair<void *, size_t>> maps;
+        auto cleanup = [&](){
+            for (int i = 0; i < maps.size(); i++){
+                if (maps[i].first){
+                    munmap(maps[i].first, maps[i].second);
+                }
+            }
+            for (int i = 0; i < spills.size(); i++){
+                fclose(spills[i]);
+            }
+        };
+        vector<char> raw;
+        for (unsigned long done = 0; done < n; ){
+            unsigned long len = min((unsigned long) BULK_SORT_MEMORY, n - done);
+            raw.resize(len * pairBytes);
+            if (fread(raw.data(), pairBytes, len, in) != len){
+                perror(("Error reading file " + filename).c_str());
+                fclose(in);
+                cleanup();
+                return false;
+            }
+            int parts = (int) min((unsigned long) threads, len);
+            vector<vector<KVPair<K,V>>> sorted(parts);
+            uint64_t base = *_seq;
+            #pragma omp parallel for schedule(static, 1)
+            for (int p = 0; p < parts; p++){
+                unsigned long lo = len * p / parts, hi = len * (p + 1) / parts;
+                sorted[p].resize(hi - lo);
+                for (unsigned long i = lo; i < hi; i++){
+                    KVPair<K,V> &kv = sorted[p][i - lo];
+                    memcpy(&kv.key, &raw[i * pairBytes], sizeof(K));
+                    memcpy(&kv.value, &raw[i * pairBytes + sizeof(K)], sizeof(V));
+                    kv.seq = base + i + 1; // 文件里越靠后越新
+                }
+                sort(sorted[p].begin(), sorted[p].end(), newerFirst);
+            }
+            *_seq += len;
+            done += len;
+            for (int p = 0; p < parts; p++){
+                if (done == len && done == n){
+                    pieces.push_back(vector<KVPair<K,V>>());
+                    pieces.back().swap(sorted[p]);
+                }
+                else {
+                    FILE *out = spillFile();
+                    if (out){
+                        spills.push_back(out);
+                    }
+                    if (!out || fwrite(sorted[p].data(), sizeof(KVPair<K,V>), sorted[p].size(), out) != sorted[p].size() || fflush(out) != 0){
+                        perror("Error writing bulk load spill file");
+                        fclose(in);
+                        cleanup();
+                        return false;
                     }
                 }
             }
         }
-        
-        return eltsInRange;
+        fclose(in);
+        typedef pair<const KVPair<K,V> *, unsigned long> Input; // 一个有序块：起始地址和长度
+        vector<Input> inputs;
+        for (int i = 0; i < pieces.size(); i++){
+            inputs.push_back(Input(pieces[i].data(), pieces[i].size()));
+        }
+        for (int i = 0; i < spills.size(); i++){
+            struct stat st;
+            void *m = fstat(fileno(spills[i]), &st) != 0 ? MAP_FAILED
+                : st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(spills[i]), 0) : nullptr;
+            if (m == MAP_FAILED){
+                perror("Error mmapping bulk load spill file");
+                cleanup();
+                return false;
+            }
+            maps.push_back(make_pair(m, (size_t) st.st_size));
+            inputs.push_back(Input((KVPair<K,V> *) m, st.st_size / sizeof(KVPair<K,V>)));
+        }
+
+        // 第二步：挑一层放得下全部数据的，建好它上面的层
+        int level = 0;
+        unsigned long runSize = diskLevels[0]->_runSize;
+        while (runSize * _diskRunsPerLevel < n){
+            runSize *= diskLevels[0]->_mergeSize;
+            ++level;
+        }
+        while (_numDiskLevels <= level){
+            ensureLevel(_numDiskLevels);
+        }
+        DiskLevel<K,V> *target = diskLevels[level];
+        unsigned long numRuns = n ? (n + target->_runSize - 1) / target->_runSize : 0;
+        unsigned long perRun = numRuns ? (n + numRuns - 1) / numRuns : 0;
+
+        // 第三步：多路归并，每个key只留最新的版本，顺序写进run里
+        typedef pair<KVPair<K,V>, int> Head;
+        auto later = [](const Head &a, const Head &b){ return newerFirst(b.first, a.first); };
+        priority_queue<Head, vector<Head>, decltype(later)> heap(later);
+        vector<unsigned long> pos(inputs.size(), 0);
+        for (int i = 0; i < inputs.size(); i++){
+            if (inputs[i].second){
+                heap.push(Head(inputs[i].first[0], i));
+            }
+        }
+        vector<unsigned long> sizes;
+        unsigned long filled = 0;
+        bool any = false;
+        K last = K();
+        while (!heap.empty()){
+            Head h = heap.top();
+            heap.pop();
+            int i = h.second;
+            if (++pos[i] < inputs[i].second){
+                heap.push(Head(inputs[i].first[pos[i]], i));
+            }
+            if (any && h.first.key == last){
+                continue;
+            }
+            any = true;
+            last = h.first.key;
+            if (h.first.value == V_TOMBSTONE){
+                continue;
+            }
+            if (sizes.empty() || filled == perRun){
+                sizes.push_back(0);
+                filled = 0;
+                // 每个key只有一个版本，导入前的快照一个也看不到，不用留每个KV的序号
+                target->runs[sizes.size() - 1]->beginWrite(false);
+            }
+            target->runs[sizes.size() - 1]->put(filled++, h.first);
+            sizes.back() = filled;
+        }
+        cleanup();
+
+        // 第四步：并行建索引，然后一起对查找可见
+        target->indexBulkRuns(sizes);
+        pthread_rwlock_wrlock(diskLock);
+        target->installBulkRuns(sizes);
+        linkRuns();
+        pthread_rwlock_unlock(diskLock);
+        // 空树上查不到的key在缓存里记成了墓碑，导入的范围要作废
+        if (rowCache && !sizes.empty()){
+            K lo = target->runs[0]->minKey, hi = target->runs[sizes.size() - 1]->maxKey;
+            rowCache->eraseRange(lo, hi);
+            rowCache->erase(hi);
+        }
+        return true;
+    }
+
+    // 批量导入的临时文件：mkstemp在当前目录建一个不会和别人重名的文件，名字马上删掉，
+    // 文件关掉就没了，出错返回或者进程退出都不会留下来；建不了返回nullptr
+    static FILE * spillFile(){
+        char name[] = "bulk_XXXXXX";
+        int fd = mkstemp(name);
+        if (fd == -1){
+            return nullptr;
+        }
+        unlink(name);
+        FILE *f = fdopen(fd, "w+b");
+        if (!f){
+            close(fd);
+        }
+        return f;
+    }
+
+    // 导入外部生成的run文件（格式见RunFileFooter，可以用DiskRun::writeRunFile生成）
+    // 放到最深的一层：从第0层到这一层都没有和文件的key范围重叠的数据，这一层有空位，而且文件不比这一层的run大；
+    // 找不到时放进第0层当最新的run。文件硬链接进来，数据不拷贝也不重写，所有KV共用一个新的写入序号
+    // 内存里和文件重叠的数据要先刷下去；不要同时写入文件范围里的key。文件不对或者放不下时返回false
+    bool ingest_file(const string &path){
+        RunFileFooter<K> footer;
+        if (!DiskRun<K,V>::readFooter(path, footer)){
+            return false;
+        }
+        K lo = footer.minKey, hi = footer.maxKey;
+        if (memoryOverlaps(lo, hi)){
+            flush();
+        }
+        lock_guard<mutex> lk(*mergeLock);
+        int level = -1;
+        bool clear = true;
+        for (int i = 0; i < _numDiskLevels; i++){
+            if (diskLevels[i]->overlaps(lo, hi)){
+                clear = false;
+                break;
+            }
+            if (!diskLevels[i]->levelFull() && !diskLevels[i]->mergeInProgress() && footer.count <= diskLevels[i]->_runSize){
+                level = i;
+            }
+        }
+        if (level == -1 && clear){
+            // 没有重叠但都放不下：往下建新的层，直到run够大
+            do {
+                ensureLevel(_numDiskLevels);
+            } while (footer.count > diskLevels[_numDiskLevels - 1]->_runSize);
+            level = _numDiskLevels - 1;
+        }
+        if (level == -1){
+            if (footer.count > diskLevels[0]->_runSize){
+                return false;
+            }
+            if (diskLevels[0]->levelFull()){
+                mergeRunsToLevel(1);
+            }
+            level = 0;
+        }
+        // 先用一个没人用的编号链接进来，装上的时候再改名
+        DiskLevel<K,V> *target = diskLevels[level];
+        DiskRun<K,V> *run = DiskRun<K,V>::openRunFile(path, level + 1, (int) target->runs.size(), _bfFalsePositiveRate);
+        if (!run){
+            return false;
+        }
+        run->globalSeq = ++*_seq;
+        target->filterKeys(run, target->_activeRun, 0, run->getCapacity());
+        target->prepareRemixAdd(vector<DiskRun<K,V> *>(1, run));
+        pthread_rwlock_wrlock(diskLock);
+        target->installRun(run);
+        linkRuns();
+        pthread_rwlock_unlock(diskLock);
+        if (rowCache){
+            rowCache->eraseRange(lo, hi);
+            rowCache->erase(hi);
+        }
+        updateCompactionDebt();
+        return true;
+    }
+
+    // 把内存里的数据全部封存，等它们刷到磁盘
+    void flush(){
+        if (!writeShards.empty()){
+            freezeShards(true);
+        }
+        while (C_0[0]->num_elements() != 0 || !rangeTombstones[0].empty()){
+            sealRuns(min(_num_to_merge, _activeRun + 1));
+        }
+        waitForFlushes();
+    }
+
+    // 内存里（跳表、分片、封存缓冲区）有没有落在[lo, hi]里的key或者范围删除
+    bool memoryOverlaps(const K &lo, const K &hi){
+        vector<Run<K,V> *> runs;
+        vector<const TombstoneSet<K> *> tombs;
+        for (int i = 0; i <= _activeRun; i++){
+            runs.push_back(C_0[i]);
+            tombs.push_back(&rangeTombstones[i]);
+        }
+        vector<SealedPtr> pending = sealedSnapshot();
+        for (int s = 0; s < pending.size(); s++){
+            for (int i = 0; i < pending[s]->runs.size(); i++){
+                runs.push_back(pending[s]->runs[i]);
+                tombs.push_back(&pending[s]->tombstones[i]);
+            }
+        }
+        for (int i = 0; i < runs.size(); i++){
+            if (runOverlaps(runs[i], lo, hi) || tombs[i]->overlaps(lo, hi)){
+                return true;
+            }
+        }
+        for (int i = 0; i < writeShards.size(); i++){
+            lock_guard<mutex> lk(writeShards[i]->lock);
+            if (runOverlaps(writeShards[i]->run, lo, hi)){
+                return true;
+            }
+        }
+        lock_guard<mutex> lk(*shardTombLock);
+        return shardTombstones.overlaps(lo, hi);
+    }
+
+    static bool runOverlaps(Run<K,V> *run, const K &lo, const K &hi){
+        RunCursor<K,V> *c = run->cursor();
+        c->seek(lo);
+        bool hit = c->valid() && !(hi < c->key());
+        delete c;
+        return hit;
+    }
+
+    // 同一个key序号大的在前
+    static bool newerFirst(const KVPair<K,V> &a, const KVPair<K,V> &b){
+        return a.key < b.key || (a.key == b.key && a.seq > b.seq);
+    }
+
+    // 树里还没有任何数据
+    bool isEmpty(){
+        if (!writeShards.empty() && *_shardElts != 0){
+            return false;
+        }
+        for (int i = 0; i <= _activeRun && i < C_0.size(); i++){
+            if (C_0[i]->num_elements() != 0 || !rangeTombstones[i].empty()){
+                return false;
+            }
+        }
+        if (!sealedSnapshot().empty()){
+            return false;
+        }
+        for (int i = 0; i < _numDiskLevels; i++){
+            if (!diskLevels[i]->levelEmpty() || diskLevels[i]->mergeInProgress()){
+                return false;
+            }
+        }
+        return true;
     }
 
     // 打印元素
     void printElts(){
-        if (mergeThread.joinable())
-            mergeThread.join();
+        waitForFlushes();
         cout << "MEMORY BUFFER" << endl;
         for (int i = 0; i <= _activeRun; i++){
             cout << "MEMORY BUFFER RUN " << i << endl;
@@ -246,9 +1035,24 @@ public:
         for (int i = 0; i < diskLevels.size(); ++i){
             cout << "Number of Elements in Disk Level " << i << "(including deletes): " << diskLevels[i]->num_elements() << endl;
         }
+        if (rowCache){
+            cout << "Row Cache Hit Rate: " << rowCache->hitRate() << ", Hits: " << rowCache->hits() << ", Misses: " << rowCache->misses() << ", Admitted: " << rowCache->admitted() << ", Rejected: " << rowCache->rejected() << endl;
+        }
+        printStallStats();
         cout << "KEY VALUE DUMP BY LEVEL: " << endl;
         printElts();
     }
+
+    void printStallStats(){
+        const char *states[] = {"normal", "delayed", "stopped"};
+        cout << "Write Stall State: " << states[writeController->state()] << endl;
+        cout << "Pending Merge Debt (KV pairs): " << writeController->debt() << endl;
+        cout << "Write Stall Time (us): " << writeController->stallMicros() << endl;
+        cout << "Delayed Writes: " << writeController->delayedWrites() << ", Write Stops: " << writeController->stops() << endl;
+        if (ioLimiter){
+            cout << "I/O Rate Limit (bytes/s): " << ioLimiter->bytesPerSecond() << ", Limited Bytes: " << ioLimiter->totalBytes() << ", I/O Wait (us): " << ioLimiter->waitMicros() << endl;
+        }
+    }
     
     //private: // TODO MAKE PRIVATE
     unsigned int _activeRun;        // 当前活跃的run；有元素的run？非空run？
@@ -261,95 +1065,592 @@ public:
     unsigned int _num_to_merge;     // 需要merge的数量
     unsigned int _pageSize;         // disk的runs映射到内存里的pagesize
     unsigned long _n;               // 好像没啥用
-    thread mergeThread;             // 合并时的线程
+    unsigned long _mergeBudget;     // 增量合并时每次插入最多推进多少个KV的合并工作，0表示不做增量合并
+    unsigned long _sealedElts;      // 封存缓冲区里的KV总数
+    unsigned long _maxSealedElts;   // 封存缓冲区的上限，超过时写线程才会等待刷盘
+    unsigned long _nextToClaim;     // 下一个要被刷盘线程领走的缓冲区序号
+    unsigned long _nextToCommit;    // 下一个要写进第0层的缓冲区序号，等于sealed.front()的序号
+    bool _stopFlush;                // 让刷盘线程在清空队列后退出
+    bool _levelFilter;              // 磁盘的每一层有没有整层共用的过滤器
+    bool _levelRemix;               // 磁盘的每一层有没有跨run的有序视图
 
-    // 合并runs到下一层
-    void mergeRunsToLevel(int level) {
-        bool isLast = false;
-        
+    // 设置增量合并的预算；开启后插入会顺带推进磁盘层之间的合并，避免刷盘时一次性级联合并所有满了的层
+    void set_merge_budget(unsigned long budget){
+        _mergeBudget = budget;
+    }
+
+    // 如果level是新的最后一层，先把它建出来
+    void ensureLevel(int level) {
         if (level == _numDiskLevels){ // if this is the last level
-            DiskLevel<K,V> * newLevel = new DiskLevel<K, V>(_pageSize, level + 1, diskLevels[level - 1]->_runSize * diskLevels[level - 1]->_mergeSize, _diskRunsPerLevel, ceil(_diskRunsPerLevel * _frac_runs_merged), _bfFalsePositiveRate);
+            DiskLevel<K,V> * newLevel = new DiskLevel<K, V>(_pageSize, level + 1, diskLevels[level - 1]->_runSize * diskLevels[level - 1]->_mergeSize, _diskRunsPerLevel, ceil(_diskRunsPerLevel * _frac_runs_merged), _bfFalsePositiveRate, diskLock);
+            newLevel->enableFilter(_levelFilter);
+            newLevel->enableRemix(_levelRemix);
+            pthread_rwlock_wrlock(diskLock);
             diskLevels.push_back(newLevel);
             _numDiskLevels++;
+            pthread_rwlock_unlock(diskLock);
         }
-        
-        if (diskLevels[level]->levelFull()) {
-            mergeRunsToLevel(level + 1); // merge down one, recursively
+    }
+
+    // 按查找的顺序把磁盘上的非空run串起来，给点查和seek做分散层叠（见DiskRun::Hint）
+    // run有变化时在磁盘写锁里调用；只有前后关系变了的run才重建bridge
+    void linkRuns(){
+        DiskRun<K,V> *prev = nullptr;
+        for (int j = 0; j < _numDiskLevels; j++){
+            for (int r = diskLevels[j]->_activeRun - 1; r >= 0; --r){
+                DiskRun<K,V> *run = diskLevels[j]->runs[r];
+                if (run->getCapacity() == 0){
+                    continue;
+                }
+                if (prev){
+                    prev->linkCascade(run);
+                }
+                prev = run;
+            }
         }
-        
+        if (prev){
+            prev->linkCascade(nullptr);
+        }
+    }
+
+    // 开始把level - 1层的runs合并到level层，level层必须还有空位
+    void beginMergeToLevel(int level) {
+        bool isLast = false;
         if(level + 1 == _numDiskLevels && diskLevels[level]->levelEmpty()){
             isLast = true;
         }
-
         vector<DiskRun<K, V> *> runsToMerge = diskLevels[level - 1]->getRunsToMerge();
-        unsigned long runLen = diskLevels[level - 1]->_runSize;
-        diskLevels[level]->addRuns(runsToMerge, runLen, isLast);
-        diskLevels[level - 1]->freeMergedRuns(runsToMerge);
+        diskLevels[level]->beginMerge(runsToMerge, isLast, snapshots->seqs());
+    }
+
+    // 推进合并到level层的任务；完成后释放上一层已经合并的runs
+    bool stepMergeToLevel(int level, unsigned long &budget, RateLimiter *limiter = nullptr) {
+        if (!diskLevels[level]->stepMerge(budget, limiter)){
+            return false;
+        }
+        vector<DiskRun<K, V> *> merged = diskLevels[level]->mergeInputs();
+        // 两层的有序视图在写锁外面建好，写锁里只换指针
+        diskLevels[level]->prepareMergeRemix();
+        diskLevels[level - 1]->prepareRemixDrop((unsigned) merged.size());
+        pthread_rwlock_wrlock(diskLock);
+        diskLevels[level]->installMerge();
+        diskLevels[level - 1]->freeMergedRuns(merged);
+        linkRuns();
+        pthread_rwlock_unlock(diskLock);
+        return true;
+    }
+
+    // 打开热点key缓存，最多缓存capacity个key；0表示关闭
+    // 要在开始读写之前设置
+    void set_row_cache(size_t capacity){
+        delete rowCache;
+        rowCache = capacity ? new RowCache<K,V>(capacity) : nullptr;
+    }
+
+    // 给C_0加一个哈希索引，点查C_0只要一次探测，不管C_0有多少个跳表；范围查询和刷盘还是走跳表
+    // 只在单写线程模式下用；打开时把C_0里已有的数据补进去
+    void set_buffer_index(bool on){
+        delete bufferIndex;
+        bufferIndex = nullptr;
+        if (!on){
+            return;
+        }
+        bufferIndex = new BufferIndex<K,V>((size_t) _num_runs * _eltsPerRun);
+        for (int i = 0; i <= _activeRun; ++i){
+            RunCursor<K,V> *c = C_0[i]->cursor();
+            for (c->seekToFirst(); c->valid(); ){
+                K k = c->key();
+                bufferIndex->put(k, c->value(), c->seq(), i);
+                // 同一个key后面是旧版本
+                while (c->valid() && c->key() == k){
+                    c->next();
+                }
+            }
+            delete c;
+        }
+    }
+
+    // 给磁盘的每一层加一个整层共用的过滤器：每层查一次就能排除整层，或者直接知道该查哪个run
+    // 每个key多占8到16个字节的内存；合并和刷盘写run时顺便把key加进去，分段拿写锁
+    void set_level_filter(bool on){
+        lock_guard<mutex> lk(*mergeLock);
+        pthread_rwlock_wrlock(diskLock);
+        _levelFilter = on;
+        for (int i = 0; i < diskLevels.size(); ++i){
+            diskLevels[i]->enableFilter(on);
+        }
+        pthread_rwlock_unlock(diskLock);
+    }
+
+    // 给磁盘的每一层维护一个跨run的有序视图：范围查询和迭代器seek在每层只二分一次，之后顺着视图读，不用在层内多路归并
+    // 每个KV多占一个字节多一点的内存；run生效或者被合并走时要把整层的视图重排一遍，在磁盘写锁外面排好再换上
+    void set_level_remix(bool on){
+        lock_guard<mutex> lk(*mergeLock);
+        pthread_rwlock_wrlock(diskLock);
+        _levelRemix = on;
+        for (int i = 0; i < diskLevels.size(); ++i){
+            diskLevels[i]->enableRemix(on);
+        }
+        pthread_rwlock_unlock(diskLock);
+    }
+
+    // 设置刷盘和合并每秒最多写多少字节；autoTune时这是上限，实际速率按合并的需求自动调整。0表示不限速
+    void set_io_rate_limit(uint64_t bytesPerSec, bool autoTune = false){
+        // the limiter is only used with mergeLock held
+        lock_guard<mutex> lk(*mergeLock);
+        delete ioLimiter;
+        ioLimiter = bytesPerSec ? new RateLimiter(bytesPerSec, autoTune) : nullptr;
+    }
+
+    // 合并runs到下一层；如果已经有进行中的增量合并，就把它做完
+    // 这里总是在刷盘的路径上，所以按ioLimiter限速；写线程上的增量合并已经有预算限制，不再限速
+    void mergeRunsToLevel(int level) {
+        ensureLevel(level);
+        
+        if (!diskLevels[level]->mergeInProgress()) {
+            if (diskLevels[level]->levelFull()) {
+                mergeRunsToLevel(level + 1); // merge down one, recursively
+            }
+            beginMergeToLevel(level);
+        }
+        unsigned long budget = ULONG_MAX;
+        stepMergeToLevel(level, budget, ioLimiter);
     }
 
-    // 合并runs，调用了mergeRunsToLevel()函数
-    void merge_runs(vector<Run<K,V>*> runs_to_merge, vector<BloomFilter<K>*> bf_to_merge){
+    // 增量合并调度：最深的任务优先，满了的层在下一层有空位时就提前开始往下合并，
+    // 这样级联合并的代价被摊到每次插入上，而不是集中在某一次刷盘；没有可做的合并时返回false
+    bool advanceMerges(unsigned long budget) {
+        unsigned long start = budget;
+        if (diskLevels[_numDiskLevels - 1]->levelFull()){
+            ensureLevel(_numDiskLevels);
+        }
+        for (int level = _numDiskLevels - 1; level >= 1 && budget != 0; --level){
+            if (!diskLevels[level]->mergeInProgress()){
+                if (!diskLevels[level - 1]->levelFull() || diskLevels[level]->levelFull()){
+                    continue;
+                }
+                beginMergeToLevel(level);
+            }
+            stepMergeToLevel(level, budget);
+        }
+        return budget != start;
+    }
+
+    // 插入时推进合并；刷盘线程持有锁时直接跳过，插入永远不在这里等待
+    void stepMerges() {
+        if (!mergeLock->try_lock()){
+            return;
+        }
+        advanceMerges(_mergeBudget);
+        updateCompactionDebt();
+        mergeLock->unlock();
+    }
+
+    // 设置写入限流：积压的合并工作（KV个数）超过slowdownDebt后按令牌桶限速，
+    // 起始速率为每秒delayedRate次写入，积压越多越慢，超过stopDebt时写入停下等待；slowdownDebt为0表示关闭
+    void set_write_stall(unsigned long slowdownDebt, unsigned long stopDebt, double delayedRate){
+        writeController->configure(slowdownDebt, stopDebt, delayedRate);
+    }
+
+    // 磁盘层之间欠下的合并工作：只在增量合并时算，
+    // 否则满了的层要等下一次刷盘才往下合并，这部分已经算在封存缓冲区里了
+    void updateCompactionDebt() {
+        unsigned long debt = 0;
+        if (_mergeBudget != 0){
+            for (int i = 0; i < _numDiskLevels; i++){
+                debt += diskLevels[i]->mergeRemaining();
+                bool merging = i + 1 < _numDiskLevels && diskLevels[i + 1]->mergeInProgress();
+                if (diskLevels[i]->levelFull() && !merging){
+                    debt += diskLevels[i]->_mergeSize * diskLevels[i]->_runSize;
+                }
+            }
+        }
+        writeController->setCompactionDebt(debt);
+    }
+
+    void throttleWrite() {
+        // 增量合并时欠下的合并只有写线程自己会做，所以被停下时先把合并做掉，而不是干等
+        bool progress = true;
+        while (_mergeBudget != 0 && progress && writeController->state() == WriteController::STOPPED){
+            mergeLock->lock();
+            progress = advanceMerges(_mergeBudget * 1024);
+            updateCompactionDebt();
+            mergeLock->unlock();
+        }
+        writeController->throttle();
+    }
+
+    // 设置刷盘线程数；0表示在写线程里同步刷盘
+    void set_flush_workers(unsigned n){
+        stopFlushWorkers();
+        startFlushWorkers(n);
+    }
+
+    // 设置封存缓冲区的上限（KV个数），写线程只在超过它时才等待刷盘
+    void set_max_sealed(unsigned long elts){
+        lock_guard<mutex> lk(*sealedLock);
+        _maxSealedElts = elts;
+        spaceCV->notify_all();
+    }
+
+    void startFlushWorkers(unsigned n){
+        _stopFlush = false;
+        for (unsigned i = 0; i < n; i++){
+            flushWorkers.push_back(thread(&LSM::flushWorker, this));
+        }
+    }
+
+    // 刷盘线程先把队列里剩下的缓冲区刷完再退出
+    void stopFlushWorkers(){
+        {
+            lock_guard<mutex> lk(*sealedLock);
+            _stopFlush = true;
+            flushCV->notify_all();
+        }
+        for (int i = 0; i < flushWorkers.size(); i++){
+            flushWorkers[i].join();
+        }
+        flushWorkers.clear();
+    }
+
+    // 等所有封存缓冲区都刷到磁盘
+    void waitForFlushes(){
+        unique_lock<mutex> lk(*sealedLock);
+        spaceCV->wait(lk, [this]{ return sealed.empty(); });
+    }
+
+    vector<SealedPtr> sealedSnapshot(){
+        lock_guard<mutex> lk(*sealedLock);
+        return vector<SealedPtr>(sealed.begin(), sealed.end());
+    }
+
+    bool flushClaimable(){
+        return _nextToClaim < _nextToCommit + sealed.size();
+    }
+
+    void flushWorker(){
+        RateLimiter::lowerIOPriority();
+        unique_lock<mutex> lk(*sealedLock);
+        while (true){
+            flushCV->wait(lk, [this]{ return _stopFlush || flushClaimable(); });
+            if (!flushClaimable()){
+                return;
+            }
+            flushNext(lk);
+        }
+    }
+
+    // 领走下一个缓冲区并刷盘；排序可以和其他刷盘线程并行，写进第0层必须按封存的顺序
+    // 调用时持有lk，返回时仍然持有
+    void flushNext(unique_lock<mutex> &lk){
+        unsigned long seq = _nextToClaim++;
+        SealedPtr buf = sealed[seq - _nextToCommit];
+        lk.unlock();
+        TombstoneSet<K> tombstones;
+        vector<KVPair<K, V>> to_merge = collect_runs(*buf, tombstones);
+        lk.lock();
+        flushCV->wait(lk, [this, seq]{ return _nextToCommit == seq; });
+        lk.unlock();
+        merge_runs(to_merge, tombstones);
+        lk.lock();
+        // the run is on disk now, so readers that miss it here will find it there
+        sealed.pop_front();
+        _sealedElts -= buf->elts;
+        writeController->setSealedDebt(_sealedElts);
+        ++_nextToCommit;
+        flushCV->notify_all();
+        spaceCV->notify_all();
+    }
+
+    // 把一批跳表合成一个有序数组：key从小到大，同一个key从新到老，只留最新的版本和还活着的快照要看的旧版本
+    // 所有范围删除合起来放进tombstones；被序号更大的范围删除覆盖、也没有快照要看的KV丢掉
+    // 范围删除只盖住序号比它小的版本，所以不用管它在哪个跳表上（分片一起封存的跳表之间也是按序号）
+    vector<KVPair<K, V>> collect_runs(SealedBuffer &buf, TombstoneSet<K> &tombstones){
         vector<KVPair<K, V>> to_merge = vector<KVPair<K,V>>();
-        to_merge.reserve(_eltsPerRun * _num_to_merge);
-        for (int i = 0; i < runs_to_merge.size(); i++){
-            auto all = (runs_to_merge)[i]->get_all();
-            
-            to_merge.insert(to_merge.begin(), all.begin(), all.end());
-            delete (runs_to_merge)[i];
-            delete (bf_to_merge)[i];
+        to_merge.reserve(buf.elts);
+        tombstones.clear();
+        for (int i = 0; i < buf.runs.size(); i++){
+            tombstones.merge(buf.tombstones[i]);
+        }
+        vector<uint64_t> snaps = snapshots->seqs();
+        auto before = [](const KVPair<K,V> &a, const KVPair<K,V> &b){
+            return a.key < b.key || (a.key == b.key && a.seq > b.seq);
+        };
+        // 顺序写入时跳表之间key不重叠，从老到新接起来已经有序，就不用再排一遍
+        bool sorted = true;
+        for (int i = 0; i < buf.runs.size(); i++){
+            RunCursor<K,V> *c = buf.runs[i]->cursor();
+            for (c->seekToFirst(); c->valid(); c->next()){
+                uint64_t deleted = tombstones.deletedAt(c->key(), c->seq());
+                if (deleted == UINT64_MAX || SnapshotList::visible(snaps, c->seq(), deleted)){
+                    KVPair<K,V> kv = {c->key(), c->value(), c->seq()};
+                    if (sorted && !to_merge.empty() && !before(to_merge.back(), kv)){
+                        sorted = false;
+                    }
+                    to_merge.push_back(kv);
+                }
+            }
+            delete c;
+        }
+        if (!sorted){
+            sort(to_merge.begin(), to_merge.end(), before);
+        }
+        tombstones.compact(snaps);
+        unsigned long w = 0;
+        for (unsigned long r = 0; r < to_merge.size(); r++){
+            if (w > 0 && to_merge[w - 1].key == to_merge[r].key && !SnapshotList::visible(snaps, to_merge[r].seq, to_merge[w - 1].seq)){
+                continue;
+            }
+            to_merge[w++] = to_merge[r];
+        }
+        to_merge.resize(w);
+        return to_merge;
+    }
+
+    // 把有序数组写成第0层的一个新run，调用了mergeRunsToLevel()函数
+    void merge_runs(vector<KVPair<K, V>> &to_merge, const TombstoneSet<K> &tombstones){
+        if (to_merge.empty() && tombstones.empty()){
+            return;
         }
-        sort(to_merge.begin(), to_merge.end());
         mergeLock->lock();
         if (diskLevels[0]->levelFull()){
             mergeRunsToLevel(1);
         }
-        diskLevels[0]->addRunByArray(&to_merge[0], to_merge.size());
+        diskLevels[0]->writeRunByArray(to_merge.data(), to_merge.size(), tombstones, ioLimiter, snapshots->seqs());
+        pthread_rwlock_wrlock(diskLock);
+        diskLevels[0]->installRun();
+        linkRuns();
+        pthread_rwlock_unlock(diskLock);
+        updateCompactionDebt();
         mergeLock->unlock();
         
     }
     
+    // 把封存好的缓冲区放进刷盘队列；只有封存缓冲区超过上限时才等待
+    void pushSealed(SealedPtr buf){
+        unique_lock<mutex> lk(*sealedLock);
+        spaceCV->wait(lk, [this]{ return sealed.empty() || _sealedElts < _maxSealedElts; });
+        sealed.push_back(buf);
+        _sealedElts += buf->elts;
+        writeController->setSealedDebt(_sealedElts);
+        if (flushWorkers.empty()){
+            flushNext(lk); // single threaded merging
+        }
+        else {
+            flushCV->notify_all();
+        }
+    }
+
+    // 打开多写线程模式，n个分片；要在开始写入之前设置，n不大于1表示单写线程
+    void set_write_shards(unsigned n){
+        assert(writeShards.empty() && num_buffer() == 0);
+        for (unsigned i = 0; n > 1 && i < n; i++){
+            WriteShard *ws = new WriteShard();
+            ws->run = new RunType(INT32_MIN, INT32_MAX);
+            ws->run->set_size(_num_to_merge * _eltsPerRun);
+            ws->filter = new BloomFilter<K>(_num_to_merge * _eltsPerRun, _bfFalsePositiveRate);
+            writeShards.push_back(ws);
+        }
+    }
+
+    // 每个线程第一次写入时领一个分片号，之后一直用它
+    unsigned shardIndex(){
+        static atomic<unsigned> nextSlot(0);
+        static thread_local unsigned slot = nextSlot++;
+        return slot % writeShards.size();
+    }
+
+    void insertSharded(K &key, V &value){
+        WriteShard &ws = *writeShards[shardIndex()];
+        unsigned long cap = _num_to_merge * _eltsPerRun;
+        while (true){
+            ws.lock.lock();
+            // 在分片锁里占一个名额，封存时持有所有分片锁，所以名额数和分片里的KV数一致
+            unsigned long c = _shardElts->load();
+            while (c < cap && !_shardElts->compare_exchange_weak(c, c + 1)){
+            }
+            if (c < cap){
+                break;
+            }
+            ws.lock.unlock();
+            freezeShards();
+        }
+        uint64_t seq = ++*_seq;
+        ws.run->insert_key(key, value, seq, snapshots->newest());
+        ws.filter->add(&key, sizeof(K));
+        ws.lock.unlock();
+    }
+
+    // 分片模式的批量写入：一次在分片锁里占下整批的名额，放不下就先封存
+    // 比一个第0层run还大的批只能拆开，每段各用一个写入序号
+    void writeShardedBatch(vector<KVPair<K,V>> &kvs, vector<K> &keys){
+        WriteShard &ws = *writeShards[shardIndex()];
+        unsigned long cap = _num_to_merge * _eltsPerRun;
+        unsigned long done = 0;
+        while (done < kvs.size()){
+            unsigned long want = min((unsigned long) kvs.size() - done, cap);
+            ws.lock.lock();
+            unsigned long c = _shardElts->load();
+            while (c + want <= cap && !_shardElts->compare_exchange_weak(c, c + want)){
+            }
+            if (c + want > cap){
+                ws.lock.unlock();
+                freezeShards(true);
+                continue;
+            }
+            uint64_t seq = ++*_seq;
+            ws.run->insert_batch(&kvs[done], want, seq, snapshots->newest());
+            ws.filter->addBatch(&keys[done], want);
+            ws.lock.unlock();
+            done += want;
+        }
+    }
+
+    // 分片模式的范围删除：标记盖住分片里和已经封存的数据中序号更小的版本，分片不用加锁
+    void deleteRangeSharded(K &key1, K &key2){
+        shardTombLock->lock();
+        shardTombstones.add(key1, key2, ++*_seq);
+        shardTombLock->unlock();
+        if (rowCache){
+            rowCache->eraseRange(key1, key2);
+        }
+    }
+
+    // 所有分片一起封存成一个缓冲区交给刷盘线程
+    // force时不管分片满没满，有数据就封存
+    void freezeShards(bool force = false){
+        lock_guard<mutex> fl(*freezeLock);
+        for (int i = 0; i < writeShards.size(); ++i){
+            writeShards[i]->lock.lock();
+        }
+        SealedPtr buf;
+        bool pending = *_shardElts != 0;
+        if (force && !pending){
+            lock_guard<mutex> lk(*shardTombLock);
+            pending = !shardTombstones.empty();
+        }
+        if (force ? pending : *_shardElts >= _num_to_merge * _eltsPerRun){ // 可能已经被别的线程封存了
+            buf = SealedPtr(new SealedBuffer());
+            buf->bySeq = true;
+            buf->elts = 0;
+            for (int i = 0; i < writeShards.size(); ++i){
+                WriteShard &ws = *writeShards[i];
+                buf->runs.push_back(ws.run);
+                buf->filters.push_back(ws.filter);
+                buf->tombstones.push_back(TombstoneSet<K>());
+                buf->elts += ws.run->num_elements();
+                ws.run = new RunType(INT32_MIN, INT32_MAX);
+                ws.run->set_size(_num_to_merge * _eltsPerRun);
+                ws.filter = new BloomFilter<K>(_num_to_merge * _eltsPerRun, _bfFalsePositiveRate);
+            }
+            shardTombLock->lock();
+            buf->tombstones.back() = shardTombstones;
+            shardTombstones.clear();
+            shardTombLock->unlock();
+            *_shardElts = 0;
+        }
+        for (int i = (int) writeShards.size() - 1; i >= 0; --i){
+            writeShards[i]->lock.unlock();
+        }
+        if (buf){
+            pushSealed(buf);
+        }
+    }
+
+    // 在一批分片封存的跳表里找key，取序号最大的版本；被范围删除覆盖时found为true并返回false
+    bool lookupBySeq(SealedBuffer &buf, const K &key, V &value, bool &found, uint64_t asOf){
+        uint64_t best = 0;
+        bool any = false;
+        for (int i = 0; i < buf.runs.size(); ++i){
+            if (!buf.filters[i]->mayContain(&key, sizeof(K))){
+                continue;
+            }
+            bool f = false;
+            uint64_t seq = 0;
+            V v = buf.runs[i]->lookup(key, f, seq, asOf);
+            if (f && (!any || seq > best)){
+                any = true;
+                best = seq;
+                value = v;
+            }
+        }
+        if (any){
+            found = true;
+            for (int i = 0; i < buf.runs.size(); ++i){
+                if (buf.tombstones[i].hides(key, best, asOf)){
+                    return false;
+                }
+            }
+            return true;
+        }
+        for (int i = 0; i < buf.runs.size(); ++i){
+            if (buf.tombstones[i].covers(key, asOf)){
+                found = true;
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // 封存最老的_num_to_merge个跳表交给刷盘线程；只有封存缓冲区超过上限时才等待
     void do_merge(){
-        if (_num_to_merge == 0)
+        sealRuns(_num_to_merge);
+    }
+
+    // 封存最老的n个跳表
+    void sealRuns(unsigned n){
+        if (n == 0)
             return;
-        vector<Run<K,V>*> runs_to_merge = vector<Run<K,V>*>();
-        vector<BloomFilter<K>*> bf_to_merge = vector<BloomFilter<K>*>();
-        for (int i = 0; i < _num_to_merge; i++){
-            runs_to_merge.push_back(C_0[i]);
-            bf_to_merge.push_back(filters[i]);
-        }
-        if (mergeThread.joinable()){
-            mergeThread.join();
-        }
-        mergeThread = thread (&LSM::merge_runs, this, runs_to_merge,bf_to_merge); // comment for single threaded merging
-//        merge_runs(runs_to_merge, bf_to_merge); // uncomment for single threaded merging
-        C_0.erase(C_0.begin(), C_0.begin() + _num_to_merge);
-        filters.erase(filters.begin(), filters.begin() + _num_to_merge);
+        SealedPtr buf = SealedPtr(new SealedBuffer());
+        buf->elts = 0;
+        for (int i = 0; i < n; i++){
+            buf->runs.push_back(C_0[i]);
+            buf->filters.push_back(filters[i]);
+            buf->tombstones.push_back(rangeTombstones[i]);
+            buf->elts += C_0[i]->num_elements();
+        }
+        pushSealed(buf);
+        bufferFilter->seal(n);
+        if (bufferIndex){
+            bufferIndex->seal(n);
+        }
+        C_0.erase(C_0.begin(), C_0.begin() + n);
+        filters.erase(filters.begin(), filters.begin() + n);
+        rangeTombstones.erase(rangeTombstones.begin(), rangeTombstones.begin() + n);
         
-        _activeRun -= _num_to_merge;
-        for (int i = _activeRun; i < _num_runs; i++){
+        _activeRun = _activeRun > n ? _activeRun - n : 0;
+        for (int i = 0; i < n; i++){
             RunType * run = new RunType(INT32_MIN,INT32_MAX);
             run->set_size(_eltsPerRun);
             C_0.push_back(run);
             
             BloomFilter<K> * bf = new BloomFilter<K>(_eltsPerRun, _bfFalsePositiveRate);
             filters.push_back(bf);
+            rangeTombstones.push_back(TombstoneSet<K>());
         }
     }
 
     unsigned long num_buffer(){
-        if (mergeThread.joinable())
-            mergeThread.join();
+        waitForFlushes();
         unsigned long total = 0;
         for (int i = 0; i <= _activeRun; ++i)
             total += C_0[i]->num_elements();
+        for (int i = 0; i < writeShards.size(); ++i){
+            lock_guard<mutex> lk(writeShards[i]->lock);
+            total += writeShards[i]->run->num_elements();
+        }
         return total;
     }
 
     unsigned long size(){
         K min = INT_MIN;
-        K max = INT_MAX;
-        auto r = range(min, max);
-        return r.size();
+        unsigned long total = 0;
+        MergeIterator<K,V> *it = newIterator();
+        for (it->seek(min); it->valid(); it->next()){
+            ++total;
+        }
+        delete it;
+        return total;
     }
 
 };
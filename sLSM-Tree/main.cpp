@@ -28,6 +28,8 @@
 #include <math.h>
 #include <random>
 #include <algorithm>
+#include <map>
+#include <unordered_map>
 #include "skipList.hpp"
 #include "bloom.hpp"
 #include "hashMap.hpp"
@@ -91,6 +93,235 @@ void bloomFilterTest(){
     
     
     
+}
+
+// 整数key的哈希：Murmur3和按类型特化的KeyHash单独比，再看布隆过滤器插入和查不存在的key的吞吐
+void keyHashTest(){
+    const int num_inserts = 1000000;
+    const double fprate = .01;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> distribution(INT32_MIN, INT32_MAX);
+    std::vector<int32_t> keys(num_inserts);
+    for (int i = 0; i < num_inserts; i++) {
+        keys[i] = distribution(gen) & ~1;
+    }
+
+    uint64_t sink = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        array<uint64_t, 2> h;
+        MurmurHash3_x64_128(&keys[i], (int) sizeof(int32_t), 0, h.data());
+        sink += h[0] ^ h[1];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double murmur = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        array<uint64_t, 2> h = KeyHash<int32_t>::hash128(keys[i]);
+        sink += h[0] ^ h[1];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double mixed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+    BloomFilter<int32_t> bf(num_inserts, fprate);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        bf.add(&keys[i], sizeof(int32_t));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double total_insert = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    // 偶数key插进去，查奇数key，几乎都不存在
+    int fp = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        int32_t k = keys[i] | 1;
+        fp += bf.mayContain(&k, sizeof(int32_t));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double total_lookup = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+    cout << "murmur hps " << (int) (num_inserts / murmur) << " keyhash hps " << (int) (num_inserts / mixed)
+         << " bloom ips " << (int) (num_inserts / total_insert) << " bloom negative lps " << (int) (num_inserts / total_lookup)
+         << " fp " << (double) fp / num_inserts << " (" << sink % 2 << ")" << endl;
+}
+
+// 测试：HashTable和unordered_map做同样的随机操作，结果要一模一样
+// key里有INT_MIN和INT_MAX；从很小的容量开始，不停扩容；删除标记攒多了会原样重排把它们清掉；最后全删掉再插回去
+void hashTableTest(){
+    std::mt19937 gen(42);
+    HashTable<int32_t, int32_t> table(1);
+    std::unordered_map<int32_t, int32_t> expected;
+    int mismatches = 0;
+    auto randomKey = [&](int domain){
+        int r = (int) (gen() % (domain + 2));
+        return r == domain ? INT32_MIN : r == domain + 1 ? INT32_MAX : r - domain / 2;
+    };
+    auto check = [&](int32_t k){
+        int32_t v = 0;
+        bool found = table.get(k, v);
+        auto it = expected.find(k);
+        if (found != (it != expected.end()) || (found && v != it->second)){
+            ++mismatches;
+        }
+    };
+    for (int round = 0; round < 4; round++){
+        // 第0、2轮插得多，表一直在长；第1、3轮删得多，删除标记攒多了会原样重排
+        int eraseShare = round % 2 ? 6 : 2;
+        int domain = round < 2 ? 1000 : 200000;
+        for (int i = 0; i < 1000000; i++){
+            int32_t k = randomKey(domain);
+            int op = (int) (gen() % 10);
+            if (op < eraseShare){
+                if (table.erase(k) != (expected.erase(k) == 1)){
+                    ++mismatches;
+                }
+            }
+            else if (op < 8){
+                table.put(k, i);
+                expected[k] = i;
+            }
+            else if (op < 9){
+                int32_t old = table.putIfEmpty(k, i);
+                auto it = expected.find(k);
+                if (it == expected.end()){
+                    expected[k] = i;
+                    mismatches += old != 0;
+                }
+                else {
+                    mismatches += old != it->second;
+                }
+            }
+            else {
+                check(k);
+            }
+            mismatches += table.size() != expected.size();
+        }
+        for (auto it = expected.begin(); it != expected.end(); ++it){
+            check(it->first);
+        }
+    }
+    // 滑动窗口：活着的key数不变，但key一直是新的，空位慢慢都变成删除标记，没空位时原样重排
+    for (int32_t i = 0; i < 1000000; i++){
+        int32_t k = 1000000 + i;
+        table.put(k, i);
+        expected[k] = i;
+        if (i >= 1000){
+            mismatches += !table.erase(k - 1000);
+            expected.erase(k - 1000);
+        }
+    }
+    mismatches += table.size() != expected.size();
+    // 全删掉，再插回去
+    std::vector<int32_t> keys;
+    for (auto it = expected.begin(); it != expected.end(); ++it){
+        keys.push_back(it->first);
+    }
+    for (int i = 0; i < keys.size(); i++){
+        mismatches += !table.erase(keys[i]);
+    }
+    mismatches += table.size() != 0;
+    for (int i = 0; i < keys.size(); i++){
+        mismatches += table.get(keys[i], expected[keys[i]]);
+        table.put(keys[i], -i);
+        expected[keys[i]] = -i;
+    }
+    for (int i = 0; i < keys.size(); i++){
+        check(keys[i]);
+    }
+    mismatches += table.size() != expected.size();
+    cout << "hash table " << (mismatches ? "FAILED" : "OK") << ", mismatches " << mismatches << ", final size " << table.size() << endl;
+}
+
+// 测试：快照。每拍一个快照就把当时的std::map存一份，之后随机插入、删除、范围删除，跳表封存、刷盘、合并照常进行
+// 每隔一段用快照点查和范围查询，结果要和拍快照时的map一模一样；老的快照中途释放，释放之后合并就可以丢掉它们看到的旧版本
+// 没有快照时查当前的数据；mode 0单写线程；1分片写；2后台刷盘加增量合并；3打开C_0哈希索引、热点缓存、整层过滤器和整层有序视图
+void snapshotTest(){
+    int mismatches = 0;
+    for (int mode = 0; mode < 4; mode++){
+        for (int big = 0; big < 2; big++){
+            LSM<int32_t, int32_t> lsm(big ? 100 : 50, big ? 10 : 3, big ? .5 : 1, .01, 64, big ? 4 : 2);
+            if (mode == 1){
+                lsm.set_write_shards(3);
+            }
+            if (mode == 2){
+                lsm.set_flush_workers(3);
+                lsm.set_merge_budget(5);
+            }
+            if (mode == 3){
+                lsm.set_buffer_index(true);
+                lsm.set_row_cache(500);
+                lsm.set_level_filter(true);
+                lsm.set_level_remix(true);
+            }
+            const int num_ops = big ? 200000 : 40000;
+            const int domain = big ? 20000 : 3000;
+            std::mt19937 gen(7 + mode);
+            std::uniform_int_distribution<int> distribution(0, domain);
+            std::map<int32_t, int32_t> expected;
+            std::vector<const Snapshot *> snaps;
+            std::vector<std::map<int32_t, int32_t>> seen;
+            auto check = [&](const Snapshot *snap, const std::map<int32_t, int32_t> &m){
+                for (int i = 0; i < 500; i++){
+                    int32_t k = distribution(gen), v = 0;
+                    bool found = snap ? lsm.lookup(k, v, snap) : lsm.lookup(k, v);
+                    auto it = m.find(k);
+                    if (found != (it != m.end()) || (found && v != it->second)){
+                        ++mismatches;
+                    }
+                }
+                int32_t lo = distribution(gen), hi = lo + 3000;
+                auto res = snap ? lsm.range(lo, hi, snap) : lsm.range(lo, hi);
+                auto it = m.lower_bound(lo);
+                for (int i = 0; i < res.size(); ++i, ++it){
+                    if (it == m.end() || it->first >= hi || res[i].key != it->first || res[i].value != it->second){
+                        ++mismatches;
+                        break;
+                    }
+                }
+                mismatches += it != m.lower_bound(hi);
+            };
+            for (int i = 0; i < num_ops; i++){
+                int32_t k = distribution(gen);
+                int op = (int) (gen() % 10);
+                if (op < 7){
+                    int32_t v = i + 1;
+                    lsm.insert_key(k, v);
+                    expected[k] = v;
+                }
+                else if (op < 9){
+                    lsm.delete_key(k);
+                    expected.erase(k);
+                }
+                else {
+                    int32_t e = k + 1 + (int32_t) (gen() % 60);
+                    lsm.delete_range(k, e);
+                    expected.erase(expected.lower_bound(k), expected.lower_bound(e));
+                }
+                if (i % (num_ops / 8) == num_ops / 16){
+                    snaps.push_back(lsm.snapshot());
+                    seen.push_back(expected);
+                }
+                if (i % (num_ops / 20) == 0){
+                    for (int s = 0; s < snaps.size(); s++){
+                        check(snaps[s], seen[s]);
+                    }
+                    check(nullptr, expected);
+                }
+                if (snaps.size() > 3 && i % (num_ops / 5) == 0){
+                    lsm.release_snapshot(snaps[0]);
+                    snaps.erase(snaps.begin());
+                    seen.erase(seen.begin());
+                }
+            }
+            for (int s = 0; s < snaps.size(); s++){
+                check(snaps[s], seen[s]);
+                lsm.release_snapshot(snaps[s]);
+            }
+            check(nullptr, expected);
+            mismatches += lsm.size() != expected.size();
+        }
+    }
+    cout << "snapshot " << (mismatches ? "FAILED" : "OK") << ", mismatches " << mismatches << endl;
 }
 
 // 测试：内存中插入和查找缓冲数据
@@ -435,7 +666,7 @@ void rangeTimeTest(){
     for (int i = 0; i < num_inserts; i++) {
         lsmTree.insert_key(to_insert[i], i);
     }
-    cout << "range_size time" << endl;
+    cout << "range_size time parallel_time" << endl;
     for (int i = 20; i < 20000001; i *= 10){
         
         int n1 = -i;
@@ -447,7 +678,13 @@ void rangeTimeTest(){
         clock_gettime(CLOCK_MONOTONIC, &finish);
         double total_range= (finish.tv_sec - start.tv_sec);
         total_range += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
-        cout << i << " " << total_range << endl;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        lsmTree.parallel_range(n1, n2);
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double total_parallel = (finish.tv_sec - start.tv_sec);
+        total_parallel += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        cout << i << " " << total_range << " " << total_parallel << endl;
         
     }
 }
@@ -495,6 +732,523 @@ void rangeTest(){
 //    lsmTree.printElts();
 }
 
+// 测试：顺序写入的快速路径和合并时整批挪run，结果和std::map比
+// pattern 0顺序key，偶尔改写、删除刚写过的key；1顺序key写到头从0重来，挪下去的run会和下一层重叠；2两段顺序key交替写，run之间互相重叠
+// mode的第0位打开整层有序视图，第1位打开整层过滤器，第2位用增量合并；中途拍一个快照，最后在快照上再查一遍
+void sequentialMergeTest(){
+    int mismatches = 0;
+    const int num_inserts = 200000;
+    for (int pattern = 0; pattern < 3; pattern++){
+        for (int mode = 0; mode < 8; mode++){
+            LSM<int, int> lsm(100, 10, .5, .01, 64, 4);
+            if (mode & 1){
+                lsm.set_level_remix(true);
+            }
+            if (mode & 2){
+                lsm.set_level_filter(true);
+            }
+            if (mode & 4){
+                lsm.set_merge_budget(20);
+            }
+            std::mt19937 gen(3 + pattern);
+            std::map<int, int> expected, seen;
+            const Snapshot *snap = nullptr;
+            auto check = [&](const Snapshot *s, const std::map<int, int> &m){
+                for (int i = 0; i < 2000; i++){
+                    int k = (int) (gen() % (num_inserts + 10)), v = 0;
+                    if (pattern == 2 && gen() % 2){
+                        k += 1 << 20;
+                    }
+                    bool found = s ? lsm.lookup(k, v, s) : lsm.lookup(k, v);
+                    auto it = m.find(k);
+                    if (found != (it != m.end()) || (found && v != it->second)){
+                        ++mismatches;
+                    }
+                }
+                if (s){
+                    return;
+                }
+                int lo = (int) (gen() % num_inserts), hi = lo + 3000;
+                auto res = lsm.range(lo, hi);
+                auto it = m.lower_bound(lo);
+                for (int j = 0; j < res.size(); ++j, ++it){
+                    if (it == m.end() || it->first >= hi || res[j].key != it->first || res[j].value != it->second){
+                        ++mismatches;
+                        break;
+                    }
+                }
+                mismatches += it != m.lower_bound(hi);
+                mismatches += lsm.size() != m.size();
+            };
+            for (int i = 0; i < num_inserts; i++){
+                int k = pattern == 1 ? i % (num_inserts / 3) : pattern == 2 ? i / 2 + (i % 2 << 20) : i;
+                int v = i;
+                if (gen() % 2000 == 0 && k > 10){
+                    k -= 1 + (int) (gen() % 10);
+                }
+                if (gen() % 50 == 0){
+                    lsm.delete_key(k);
+                    expected.erase(k);
+                }
+                else {
+                    lsm.insert_key(k, v);
+                    expected[k] = v;
+                }
+                if (i == num_inserts / 2){
+                    snap = lsm.snapshot();
+                    seen = expected;
+                }
+                if (i % 50000 == 0){
+                    check(nullptr, expected);
+                }
+            }
+            check(nullptr, expected);
+            check(snap, seen);
+            lsm.release_snapshot(snap);
+        }
+    }
+    cout << "sequential merge " << (mismatches ? "FAILED" : "OK") << ", mismatches " << mismatches << endl;
+}
+
+// 测试：run的范围过滤器
+// 先单独测RangeFilter：稀疏和中等密度的key一个个add进去，[lo, hi]里有key时必须说可能有，没有时记一下误判率
+// 再测整棵树：稀疏的随机key加上删除和范围删除，短范围查询、迭代器seek和并行范围查询的结果要和std::map一样
+void rangeFilterTest(){
+    int mismatches = 0;
+    std::mt19937 gen(9);
+    for (int density = 0; density < 2; density++){
+        std::vector<int32_t> keys(100000);
+        for (int i = 0; i < keys.size(); i++){
+            keys[i] = density ? (int32_t) (gen() % 4000000) : (int32_t) gen();
+        }
+        sort(keys.begin(), keys.end());
+        RangeFilter<int32_t> filter;
+        filter.begin(RangeFilter<int32_t>::count(keys.size(), [&](unsigned long j){ return keys[j]; }));
+        for (int i = 0; i < keys.size(); i++){
+            filter.add(keys[i]);
+        }
+        int negatives = 0, fp = 0;
+        for (int i = 0; i < 200000; i++){
+            int64_t lo = i % 2 ? (int64_t) keys[gen() % keys.size()] - gen() % 50 : density ? (int64_t) (gen() % 4000000) : (int32_t) gen();
+            int64_t hi = lo + gen() % 100;
+            if (lo < INT32_MIN || hi > INT32_MAX){
+                continue;
+            }
+            bool present = lower_bound(keys.begin(), keys.end(), (int32_t) lo) != upper_bound(keys.begin(), keys.end(), (int32_t) hi);
+            bool maybe = filter.mayContain((int32_t) lo, (int32_t) hi);
+            mismatches += present && !maybe;
+            negatives += !present;
+            fp += !present && maybe;
+        }
+        cout << "range filter " << (density ? "medium" : "sparse") << " fp " << (double) fp / negatives << endl;
+    }
+
+    LSM<int32_t, int32_t> lsm(800, 20, 1.0, .01, 1024, 20);
+    std::map<int32_t, int32_t> expected;
+    for (int i = 0; i < 1000000; i++){
+        int32_t k = (int32_t) gen();
+        int op = (int) (gen() % 100);
+        if (op < 90){
+            lsm.insert_key(k, i);
+            expected[k] = i;
+        }
+        else if (op < 99 && !expected.empty()){
+            // 删一个存在的key
+            auto it = expected.lower_bound(k);
+            if (it == expected.end()){
+                it = expected.begin();
+            }
+            int32_t dk = it->first;
+            lsm.delete_key(dk);
+            expected.erase(it);
+        }
+        else {
+            if (k < INT32_MAX - 100000){
+                int32_t e = k + (int32_t) (gen() % 100000);
+                lsm.delete_range(k, e);
+                expected.erase(expected.lower_bound(k), expected.lower_bound(e));
+            }
+        }
+    }
+    auto same = [&](const vector<KVPair<int32_t, int32_t>> &res, int32_t lo, int32_t hi){
+        auto it = expected.lower_bound(lo);
+        for (int j = 0; j < res.size(); ++j, ++it){
+            if (it == expected.end() || it->first >= hi || res[j].key != it->first || res[j].value != it->second){
+                return false;
+            }
+        }
+        return it == expected.lower_bound(hi);
+    };
+    for (int i = 0; i < 200000; i++){
+        int32_t lo = i % 2 ? (int32_t) gen() : expected.lower_bound((int32_t) gen()) == expected.end() ? 0 : expected.lower_bound((int32_t) gen())->first;
+        if (lo > INT32_MAX - 101){
+            continue;
+        }
+        int32_t hi = lo + 1 + (int32_t) (gen() % 100);
+        mismatches += !same(lsm.range(lo, hi), lo, hi);
+        if (i % 100 == 0){
+            vector<KVPair<int32_t, int32_t>> res;
+            MergeIterator<int32_t, int32_t> *it = lsm.newIterator(hi);
+            for (it->seek(lo); it->valid(); it->next()){
+                res.push_back(it->current());
+            }
+            delete it;
+            mismatches += !same(res, lo, hi);
+        }
+        if (i % 1000 == 0 && lo < INT32_MAX - 50000000){
+            int32_t wide = lo + 50000000;
+            mismatches += !same(lsm.parallel_range(lo, wide), lo, wide);
+        }
+    }
+    cout << "range filter " << (mismatches ? "FAILED" : "OK") << ", mismatches " << mismatches << endl;
+}
+
+// 测试：导入外部run文件，文件用DiskRun::writeRunFile生成
+// 和已有数据不重叠的文件放到最深的、有空位放得下的一层；重叠的放进第0层当最新的run，盖住老的版本，导入前拿的快照还是看到老的
+// footer不对、key没排好序、和已有数据重叠但比第0层的run还大的文件都要拒绝，树不变
+void ingestFileTest(){
+    int mismatches = 0;
+    LSM<int, int> lsm(100, 10, 1, .01, 64, 4);
+    std::mt19937 gen(13);
+    std::map<int, int> expected;
+    const int domain = 200000;
+    for (int i = 0; i < 300000; i++){
+        int k = (int) (gen() % domain);
+        lsm.insert_key(k, i);
+        expected[k] = i;
+    }
+    lsm.flush();
+    auto check = [&](){
+        for (int i = 0; i < 5000; i++){
+            int k = (int) (gen() % (2 * domain)), v = 0;
+            bool found = lsm.lookup(k, v);
+            auto it = expected.find(k);
+            if (found != (it != expected.end()) || (found && v != it->second)){
+                ++mismatches;
+            }
+        }
+        int lo = (int) (gen() % (2 * domain)), hi = lo + 5000;
+        auto res = lsm.range(lo, hi);
+        auto it = expected.lower_bound(lo);
+        for (int j = 0; j < res.size(); ++j, ++it){
+            if (it == expected.end() || it->first >= hi || res[j].key != it->first || res[j].value != it->second){
+                ++mismatches;
+                break;
+            }
+        }
+        mismatches += it != expected.lower_bound(hi);
+        mismatches += lsm.size() != expected.size();
+    };
+    // 从lo开始每隔step一个key，共n个
+    auto makeFile = [&](const string &path, int lo, int step, int n, int value){
+        vector<KVPair<int, int>> kvs(n);
+        for (int i = 0; i < n; i++){
+            kvs[i].key = lo + i * step;
+            kvs[i].value = value + i;
+            kvs[i].seq = 0;
+        }
+        return DiskRun<int, int>::writeRunFile(path, kvs.data(), n, 64);
+    };
+    // 文件装在哪一层：找首key等于lo的run
+    auto levelOf = [&](int lo){
+        for (int i = 0; i < lsm.diskLevels.size(); i++){
+            for (int r = 0; r < lsm.diskLevels[i]->_activeRun; r++){
+                if (lsm.diskLevels[i]->runs[r]->getCapacity() != 0 && lsm.diskLevels[i]->runs[r]->minKey == lo){
+                    return i;
+                }
+            }
+        }
+        return -1;
+    };
+    // 按ingest_file的规则算不重叠的文件该放哪层
+    auto clearLevel = [&](unsigned long count){
+        int level = -1;
+        for (int i = 0; i < lsm.diskLevels.size(); i++){
+            if (!lsm.diskLevels[i]->levelFull() && !lsm.diskLevels[i]->mergeInProgress() && count <= lsm.diskLevels[i]->_runSize){
+                level = i;
+            }
+        }
+        return level;
+    };
+
+    // 不重叠：放到最深的一层，不是第0层
+    int want = clearLevel(500);
+    mismatches += want <= 0;
+    mismatches += !makeFile("ingest_clear.run", 2 * domain, 3, 500, 1000000);
+    mismatches += !lsm.ingest_file("ingest_clear.run");
+    remove("ingest_clear.run");
+    mismatches += levelOf(2 * domain) != want;
+    for (int i = 0; i < 500; i++){
+        expected[2 * domain + i * 3] = 1000000 + i;
+    }
+    check();
+
+    // 重叠：进第0层，新的序号盖住老的版本；之前拿的快照看不到文件
+    const Snapshot *snap = lsm.snapshot();
+    std::map<int, int> seen = expected;
+    mismatches += !makeFile("ingest_overlap.run", 1000, 7, 90, 2000000);
+    mismatches += !lsm.ingest_file("ingest_overlap.run");
+    remove("ingest_overlap.run");
+    mismatches += levelOf(1000) != 0;
+    for (int i = 0; i < 90; i++){
+        expected[1000 + i * 7] = 2000000 + i;
+    }
+    check();
+    for (int i = 0; i < 90; i++){
+        int k = 1000 + i * 7, v = 0;
+        bool found = lsm.lookup(k, v, snap);
+        auto it = seen.find(k);
+        if (found != (it != seen.end()) || (found && v != it->second)){
+            ++mismatches;
+        }
+    }
+    lsm.release_snapshot(snap);
+    // 之后的写入又盖住文件里的key，合并下去以后还是对的
+    for (int i = 0; i < 100000; i++){
+        int k = (int) (gen() % domain), v = -i;
+        lsm.insert_key(k, v);
+        expected[k] = v;
+    }
+    check();
+
+    // 拒绝：footer不对，key没排好序，和已有数据重叠但比第0层的run大；树不变
+    unsigned long before = lsm.size();
+    mismatches += !makeFile("ingest_bad.run", 5000, 1, 90, 3000000);
+    FILE *f = fopen("ingest_bad.run", "r+b");
+    fseek(f, -1, SEEK_END);
+    fputc(0x55, f);
+    fseek(f, -(long) sizeof(RunFileFooter<int>), SEEK_END);
+    fputc(0, f);
+    fclose(f);
+    mismatches += lsm.ingest_file("ingest_bad.run");
+    remove("ingest_bad.run");
+    mismatches += !makeFile("ingest_unsorted.run", 5000, -1, 90, 3000000);
+    mismatches += lsm.ingest_file("ingest_unsorted.run");
+    remove("ingest_unsorted.run");
+    mismatches += !makeFile("ingest_big.run", 0, 1, (int) lsm.diskLevels[0]->_runSize + 1, 3000000);
+    mismatches += lsm.ingest_file("ingest_big.run");
+    remove("ingest_big.run");
+    mismatches += lsm.size() != before;
+    check();
+    cout << "ingest file " << (mismatches ? "FAILED" : "OK") << ", mismatches " << mismatches << endl;
+}
+
+// 多写线程写入吞吐：每个线程写自己的分片，线程数从1翻倍到maxThreads
+void shardedInsertTest(unsigned maxThreads = 16){
+    const int num_inserts = 4000000;
+    const int num_runs = 20;
+    const int buffer_capacity = 800;
+    const double bf_fp = .001;
+    const int pageSize = 512;
+    const int disk_runs_per_level = 10;
+    const double merge_fraction = 1;
+    std::uniform_int_distribution<int> distribution(INT_MIN, INT_MAX);
+    std::vector<int> to_insert;
+    for (int i = 0; i < num_inserts; i++) {
+        to_insert.push_back(distribution(generator));
+    }
+    cout << "threads ips" << endl;
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2){
+        auto lsmTree = LSM<int32_t, int32_t>(buffer_capacity, num_runs, merge_fraction, bf_fp, pageSize, disk_runs_per_level);
+        lsmTree.set_write_shards(threads);
+        vector<thread> writers;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned t = 0; t < threads; t++){
+            writers.push_back(thread([&lsmTree, &to_insert, t, threads]{
+                for (int i = t; i < num_inserts; i += threads){
+                    lsmTree.insert_key(to_insert[i], i);
+                }
+            }));
+        }
+        for (int t = 0; t < writers.size(); t++){
+            writers[t].join();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double total_insert = (finish.tv_sec - start.tv_sec);
+        total_insert += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        cout << threads << " " << (int) (num_inserts / total_insert) << endl;
+    }
+}
+
+// 测试：单个插入和WriteBatch批量插入的吞吐
+void writeBatchTest(){
+    const int num_inserts = 4000000;
+    const int num_runs = 20;
+    const int buffer_capacity = 800;
+    const double bf_fp = .001;
+    const int pageSize = 512;
+    const int disk_runs_per_level = 10;
+    const double merge_fraction = 1;
+    std::uniform_int_distribution<int> distribution(INT_MIN, INT_MAX);
+    std::vector<int> to_insert;
+    for (int i = 0; i < num_inserts; i++) {
+        to_insert.push_back(distribution(generator));
+    }
+    cout << "batch ips" << endl;
+    for (int batchSize = 1; batchSize <= 4096; batchSize *= 8){
+        auto lsmTree = LSM<int32_t, int32_t>(buffer_capacity, num_runs, merge_fraction, bf_fp, pageSize, disk_runs_per_level);
+        WriteBatch<int32_t, int32_t> batch;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_inserts; i++){
+            if (batchSize == 1){
+                lsmTree.insert_key(to_insert[i], i);
+                continue;
+            }
+            batch.put(to_insert[i], i);
+            if (batch.size() == batchSize || i + 1 == num_inserts){
+                lsmTree.write(batch);
+                batch.clear();
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double total_insert = (finish.tv_sec - start.tv_sec);
+        total_insert += (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+        cout << batchSize << " " << (int) (num_inserts / total_insert) << endl;
+    }
+}
+
+// 同样的随机插入和查找，memory buffer分别用跳表和ART
+template <class RunType>
+void memtableTest(const char *name){
+    const int num_inserts = 1000000;
+    const int num_runs = 20;
+    const int buffer_capacity = 800;
+    const double bf_fp = .001;
+    const int pageSize = 512;
+    const int disk_runs_per_level = 20;
+    const double merge_fraction = 1;
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> distribution(INT32_MIN, INT32_MAX);
+    std::vector<int> to_insert;
+    for (int i = 0; i < num_inserts; i++) {
+        to_insert.push_back(distribution(gen));
+    }
+
+    // 只有一个run，看数据结构本身
+    RunType run(INT32_MIN, INT32_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        run.insert_key(to_insert[i], i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double run_insert = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        bool found = false;
+        run.lookup(to_insert[i], found);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double run_lookup = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+    // 整棵树，同insertLookupTest
+    auto lsmTree = LSM<int32_t, int32_t, RunType>(buffer_capacity, num_runs, merge_fraction, bf_fp, pageSize, disk_runs_per_level);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        lsmTree.insert_key(to_insert[i], i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double total_insert = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+    int lookup;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < num_inserts; i++) {
+        lsmTree.lookup(to_insert[i], lookup);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double total_lookup = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+    cout << name << " run ips " << (int) (num_inserts / run_insert) << " run lps " << (int) (num_inserts / run_lookup)
+         << " lsm ips " << (int) (num_inserts / total_insert) << " lsm lps " << (int) (num_inserts / total_lookup) << endl;
+}
+
+// 测试：跳表的finger search，和std::map比
+// key大多在上一个key附近随机游走，偶尔跳远、往回走；两个跳表交替写，finger要认得出不是自己的跳表；删除会让finger作废
+// 最后两个线程拿锁轮流写同一个跳表，各自的finger里的前驱被对方插的节点隔开了
+// 每一步之后点查，最后整个跳表的链接顺序、范围查询和元素个数都要和map一样
+void fingerSearchTest(){
+    int mismatches = 0;
+    std::mt19937 gen(5);
+    SkipList<int32_t, int32_t> first(INT32_MIN, INT32_MAX), second(INT32_MIN, INT32_MAX);
+    SkipList<int32_t, int32_t> *lists[2] = {&first, &second};
+    std::map<int32_t, int32_t> expected[2];
+    auto compare = [&](SkipList<int32_t, int32_t> &list, const std::map<int32_t, int32_t> &m){
+        auto all = list.get_all();
+        mismatches += all.size() != m.size() || list.num_elements() != m.size();
+        auto it = m.begin();
+        for (int j = 0; j < all.size() && it != m.end(); ++j, ++it){
+            if (all[j].key != it->first || all[j].value != it->second){
+                ++mismatches;
+                break;
+            }
+        }
+        for (int i = 0; i < 100; i++){
+            int32_t lo = (int32_t) (gen() % 200000) - 100000, hi = lo + (int32_t) (gen() % 5000);
+            auto res = list.get_all_in_range(lo, hi);
+            auto e = m.lower_bound(lo);
+            for (int j = 0; j < res.size(); ++j, ++e){
+                if (e == m.end() || e->first >= hi || res[j].key != e->first){
+                    ++mismatches;
+                    break;
+                }
+            }
+            mismatches += e != m.lower_bound(hi);
+        }
+    };
+    int32_t pos[2] = {0, 0};
+    for (int i = 0; i < 2000000; i++){
+        int l = (int) (gen() % 2);
+        int r = (int) (gen() % 100);
+        pos[l] += r < 90 ? (int32_t) (gen() % 16) - 4 : r < 98 ? (int32_t) (gen() % 2000) - 1000 : (int32_t) (gen() % 200000) - 100000;
+        pos[l] = std::max(-100000, std::min(100000, pos[l]));
+        int32_t k = pos[l];
+        if (gen() % 5 == 0){
+            lists[l]->delete_key(k);
+            expected[l].erase(k);
+        }
+        else {
+            lists[l]->insert_key(k, i);
+            expected[l][k] = i;
+        }
+        int32_t q = k + (int32_t) (gen() % 9) - 4;
+        bool found = false;
+        int32_t v = lists[l]->lookup(q, found);
+        auto it = expected[l].find(q);
+        if (found != (it != expected[l].end()) || (found && v != it->second)){
+            ++mismatches;
+        }
+    }
+    compare(first, expected[0]);
+    compare(second, expected[1]);
+
+    SkipList<int32_t, int32_t> shared(INT32_MIN, INT32_MAX);
+    std::map<int32_t, int32_t> sharedExpected;
+    std::mutex lock;
+    vector<thread> writers;
+    for (int t = 0; t < 2; t++){
+        writers.push_back(thread([&, t]{
+            std::mt19937 tgen(100 + t);
+            int32_t p = t ? 50000 : -50000;
+            for (int i = 0; i < 500000; i++){
+                p += (int32_t) (tgen() % 16) - 4;
+                p = std::max(-100000, std::min(100000, p));
+                lock_guard<mutex> lk(lock);
+                if (tgen() % 5 == 0){
+                    shared.delete_key(p);
+                    sharedExpected.erase(p);
+                }
+                else {
+                    shared.insert_key(p, i);
+                    sharedExpected[p] = i;
+                }
+            }
+        }));
+    }
+    for (int t = 0; t < writers.size(); t++){
+        writers[t].join();
+    }
+    compare(shared, sharedExpected);
+    cout << "finger search " << (mismatches ? "FAILED" : "OK") << ", mismatches " << mismatches << endl;
+}
+
 void concurrentLookupTest(){
     std::random_device                  rand_dev;
     std::mt19937                        generator(rand_dev());
@@ -606,7 +1360,8 @@ void concurrentLookupTest(){
     }
 }
 
-void tailLatencyTest(){
+// mergeBudget为0时是原来的行为：刷盘线程一次性做完级联合并；否则每次插入最多推进mergeBudget个KV的合并工作
+void tailLatencyTest(unsigned long mergeBudget = 0){
     std::random_device                  rand_dev;
     std::mt19937                        generator(rand_dev());
     std::uniform_int_distribution<int>  distribution(INT32_MIN, INT32_MAX);
@@ -620,6 +1375,7 @@ void tailLatencyTest(){
     const int disk_runs_per_level = 2;
     const double merge_fraction = 1;
     LSM<int32_t, int32_t> lsmTree = LSM<int32_t, int32_t>(buffer_capacity, num_runs,merge_fraction, bf_fp, pageSize, disk_runs_per_level);
+    lsmTree.set_merge_budget(mergeBudget);
     
     std::vector<int> to_insert;
     for (int i = 0; i < num_inserts; i++) {
@@ -628,7 +1384,8 @@ void tailLatencyTest(){
     }
     shuffle(to_insert.begin(), to_insert.end(), generator);
     
-    auto times = vector<double>(num_inserts);
+    auto times = vector<double>();
+    times.reserve(num_inserts);
     
     //    std::cout << "Starting inserts" << std::endl;
     
@@ -639,7 +1396,11 @@ void tailLatencyTest(){
         times.push_back((finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1000000000.);
     }
     sort(times.begin(), times.end());
+    cout << "merge budget: " << mergeBudget << endl;
     cout << "largest latency: " << times[times.size() - 1] << endl;
+    cout << "p99.99 latency: " << times[(size_t) (times.size() * .9999)] << endl;
+    cout << "p99 latency: " << times[(size_t) (times.size() * .99)] << endl;
+    cout << "median latency: " << times[times.size() / 2] << endl;
     cout << "smallest latency: " << times[0] << endl;
 
 }
@@ -810,11 +1571,23 @@ void queryLine(LSM<int, int> &lsm, const string &line, vector<string> &strings){
             lsm.delete_key(dk);
         }
             break;
+        case 'D': {
+            int dk1 = stoi(strings[1]);
+            int dk2 = stoi(strings[2]);
+            lsm.delete_range(dk1, dk2);
+        }
+            break;
         case 'l': {
             string ls = strings[1];
             loadFromBin(lsm, ls);
         }
             break;
+        case 'b': {
+            // 批量导入，见LSM::bulk_load；文件格式和l一样
+            string bs = strings[1];
+            lsm.bulk_load(bs);
+        }
+            break;
         case 's': {
             lsm.printStats();
         }
@@ -824,14 +1597,112 @@ void queryLine(LSM<int, int> &lsm, const string &line, vector<string> &strings){
 
 }
 
+// 测试：范围删除。随机插入、删除、范围删除，和std::map做同样的操作；一半的写入走查询命令p、d、D
+// 每一轮先查一遍，flush把内存里的数据都刷到磁盘以后再查一遍：点查、范围查询、size都要和map一样
+// mode 0默认；1增量合并；2热点缓存；3两个都打开
+void deleteRangeTest(){
+    int mismatches = 0;
+    for (int mode = 0; mode < 4; mode++){
+        LSM<int, int> lsm(100, 5, .5, .01, 64, 3);
+        if (mode & 1){
+            lsm.set_merge_budget(5);
+        }
+        if (mode & 2){
+            lsm.set_row_cache(500);
+        }
+        const int domain = 10000;
+        std::mt19937 gen(11 + mode);
+        std::uniform_int_distribution<int> distribution(0, domain);
+        std::map<int, int> expected;
+        vector<string> strings(3);
+        auto check = [&](){
+            for (int i = 0; i < 2000; i++){
+                int k = distribution(gen), v = 0;
+                bool found = lsm.lookup(k, v);
+                auto it = expected.find(k);
+                if (found != (it != expected.end()) || (found && v != it->second)){
+                    ++mismatches;
+                }
+            }
+            for (int i = 0; i < 20; i++){
+                int lo = distribution(gen), hi = lo + (int) (gen() % 2000);
+                auto res = lsm.range(lo, hi);
+                auto it = expected.lower_bound(lo);
+                for (int j = 0; j < res.size(); ++j, ++it){
+                    if (it == expected.end() || it->first >= hi || res[j].key != it->first || res[j].value != it->second){
+                        ++mismatches;
+                        break;
+                    }
+                }
+                mismatches += it != expected.lower_bound(hi);
+            }
+            mismatches += lsm.size() != expected.size();
+        };
+        for (int round = 0; round < 20; round++){
+            for (int i = 0; i < 5000; i++){
+                int k = distribution(gen);
+                int op = (int) (gen() % 10);
+                bool dsl = gen() % 2;
+                if (op < 6){
+                    int v = round * 5000 + i + 1;
+                    if (dsl){
+                        queryLine(lsm, "p " + to_string(k) + " " + to_string(v), strings);
+                    }
+                    else {
+                        lsm.insert_key(k, v);
+                    }
+                    expected[k] = v;
+                }
+                else if (op < 8){
+                    if (dsl){
+                        queryLine(lsm, "d " + to_string(k), strings);
+                    }
+                    else {
+                        lsm.delete_key(k);
+                    }
+                    expected.erase(k);
+                }
+                else {
+                    // 偶尔删一大段，盖住整个run
+                    int e = k + 1 + (int) (gen() % (op == 9 && gen() % 10 == 0 ? 3000 : 80));
+                    if (dsl){
+                        queryLine(lsm, "D " + to_string(k) + " " + to_string(e), strings);
+                    }
+                    else {
+                        lsm.delete_range(k, e);
+                    }
+                    expected.erase(expected.lower_bound(k), expected.lower_bound(e));
+                }
+            }
+            check();
+            lsm.flush();
+            check();
+        }
+    }
+    cout << "delete range " << (mismatches ? "FAILED" : "OK") << ", mismatches " << mismatches << endl;
+}
+
 int main(int argc, char *argv[]){
 
 //    insertLookupTest();
 //    updateDeleteTest();
 //    rangeTest();
+//    sequentialMergeTest();
+//    rangeFilterTest();
+//    ingestFileTest();
 //    rangeTimeTest();
 //    concurrentLookupTest();
+//    shardedInsertTest();
+//    writeBatchTest();
+//    memtableTest<SkipList<int32_t, int32_t>>("skiplist");
+//    memtableTest<ARTRun<int32_t, int32_t>>("art");
+//    fingerSearchTest();
+//    keyHashTest();
+//    hashTableTest();
+//    snapshotTest();
+//    deleteRangeTest();
 //    tailLatencyTest();
+//    tailLatencyTest(64);
 //    cartesianTest();
 //    updateLookupSkewTest();
     
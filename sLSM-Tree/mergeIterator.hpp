@@ -0,0 +1,211 @@
+//
+//  mergeIterator.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef mergeIterator_h
+#define mergeIterator_h
+
+#include <vector>
+#include <queue>
+#include <functional>
+#include <utility>
+#include <memory>
+#include <pthread.h>
+#include "run.hpp"
+#include "diskLevel.hpp"
+#include "rangeTombstone.hpp"
+
+using namespace std;
+
+// 在所有跳表和磁盘run上按key从小到大流式遍历：同一个key只给出最新的版本，跳过墓碑和被范围删除覆盖的key
+// 输入按从新到老的顺序加进来；用小根堆做多路归并，seek是O(log n)，之后每个next是O(log 输入个数)
+// 给了asOf时只看序号不大于asOf的写入，同一个key取其中最新的版本
+// 存活期间持有磁盘的读锁，合并结果没法生效，所以不要在持有迭代器的线程里写入
+template <class K, class V>
+class MergeIterator {
+public:
+    typedef KVPair<K,V> KVPair_t;
+
+    // upper是不包含的上界
+    MergeIterator(pthread_rwlock_t *diskLock, const K &upper, uint64_t asOf = UINT64_MAX): _diskLock(diskLock), _upper(upper), _asOf(asOf), _coveredFrom(upper), _valid(false) {
+        if (_diskLock){
+            pthread_rwlock_rdlock(_diskLock);
+        }
+    }
+
+    ~MergeIterator(){
+        for (int i = 0; i < _sources.size(); i++){
+            delete _sources[i].cur;
+        }
+        if (_diskLock){
+            pthread_rwlock_unlock(_diskLock);
+        }
+    }
+
+    MergeIterator(const MergeIterator &) = delete;
+    MergeIterator &operator=(const MergeIterator &) = delete;
+
+    // 加一个内存里的跳表，tombstones是它上面的范围删除
+    // sameGroup表示和上一个输入属于同一批（多写线程的各个分片），同一批里同一个key按写入序号取最新的
+    void addRun(Run<K,V> *run, const TombstoneSet<K> &tombstones, bool sameGroup = false){
+        int rank = _sources.empty() ? 0 : _sources.back().rank + (sameGroup ? 0 : 1);
+        Source s = {run->cursor(), &tombstones, rank, nullptr};
+        _sources.push_back(s);
+    }
+
+    // 迭代器存活期间保持p不被释放，用来留住还没刷完的封存缓冲区
+    void pin(shared_ptr<void> p){
+        _pinned.push_back(p);
+    }
+
+    void addDiskRun(DiskRun<K,V> *run){
+        int rank = _sources.empty() ? 0 : _sources.back().rank + 1;
+        Source s = {run->cursor(&_hint), &run->tombstones, rank, run};
+        _sources.push_back(s);
+    }
+
+    // 加一整层磁盘run，用这一层的有序视图（DiskLevel::remixUsable()时才能用），本层没有范围删除
+    void addDiskLevel(DiskLevel<K,V> *level){
+        int rank = _sources.empty() ? 0 : _sources.back().rank + 1;
+        Source s = {level->remixCursor(), &_noTombstones, rank, nullptr};
+        _sources.push_back(s);
+    }
+
+    // 定位到第一个不小于key的可见key
+    void seek(const K &key){
+        if (_deletes.size() != _sources.size() || key < _coveredFrom){
+            computeCoverage(key);
+        }
+        _heap = Heap();
+        _hint = typename DiskRun<K,V>::Hint();
+        for (int i = 0; i < _sources.size(); i++){
+            // 范围过滤器说磁盘run在[key, _upper)里没有key，就不用seek，也不进堆
+            if (_sources[i].disk && !_sources[i].disk->mayOverlap(key, _upper)){
+                continue;
+            }
+            _sources[i].cur->seek(key);
+            settle(i);
+        }
+        findNext();
+    }
+
+    bool valid() const {
+        return _valid;
+    }
+
+    void next(){
+        findNext();
+    }
+
+    const K &key() const {
+        return _cur.key;
+    }
+
+    const V &value() const {
+        return _cur.value;
+    }
+
+    const KVPair_t &current() const {
+        return _cur;
+    }
+
+private:
+    // 一个有序的输入：跳表或者磁盘run上的游标
+    struct Source {
+        RunCursor<K,V> *cur;
+        const TombstoneSet<K> *tombstones;
+        int rank; // 越小越新
+        DiskRun<K,V> *disk; // 单个磁盘run的输入，别的是nullptr
+    };
+    // (key, 输入编号)：同一个key编号小的更新，先弹出
+    typedef priority_queue<pair<K, int>, vector<pair<K, int>>, greater<pair<K, int>>> Heap;
+
+    pthread_rwlock_t *_diskLock;
+    K _upper;
+    uint64_t _asOf;
+    typename DiskRun<K,V>::Hint _hint; // 磁盘run按查找顺序加进来，seek时一个接一个往下传
+    vector<Source> _sources;          // 从新到老
+    TombstoneSet<K> _noTombstones;
+    vector<shared_ptr<void>> _pinned;
+    vector<TombstoneSet<K>> _deletes; // _deletes[i]：输入i所在的批次和比它新的批次上、和[_coveredFrom, _upper)重叠的范围删除
+    K _coveredFrom;                   // 之后seek到更小的key时要重新算_deletes
+    Heap _heap;
+    KVPair_t _cur;
+    bool _valid;
+
+    // 范围删除只盖住序号比它小的版本，同一批里的和输入自己的也一起算
+    // 只取和[from, _upper)重叠的范围删除：范围删除很多时短的范围查询不用每次把它们全拷一遍
+    void computeCoverage(const K &from){
+        _deletes.assign(_sources.size(), TombstoneSet<K>());
+        _coveredFrom = from;
+        TombstoneSet<K> seen;
+        for (int i = 0; i < _sources.size(); ){
+            int g = i;
+            for (; g < _sources.size() && _sources[g].rank == _sources[i].rank; g++){
+                seen.merge(_sources[g].tombstones->clip(from, _upper));
+            }
+            for (; i < g; i++){
+                _deletes[i] = seen;
+            }
+        }
+    }
+
+    // 跳过快照之后的写入和在快照时已经被范围删除的KV，还有剩余就放进堆
+    void settle(int i){
+        RunCursor<K,V> *c = _sources[i].cur;
+        while (c->valid() && c->key() < _upper && (c->seq() > _asOf || _deletes[i].hides(c->key(), c->seq(), _asOf))){
+            c->next();
+        }
+        if (c->valid() && c->key() < _upper){
+            _heap.push(make_pair(c->key(), i));
+        }
+    }
+
+    void findNext(){
+        while (!_heap.empty()){
+            int newest = _heap.top().second;
+            KVPair_t kv = {_sources[newest].cur->key(), _sources[newest].cur->value(), _sources[newest].cur->seq()};
+            // 老版本全部跳过；和最新的输入同一批的，序号大的胜出
+            while (!_heap.empty() && _heap.top().first == kv.key){
+                int i = _heap.top().second;
+                _heap.pop();
+                if (_sources[i].rank == _sources[newest].rank && _sources[i].cur->seq() > kv.seq){
+                    kv.value = _sources[i].cur->value();
+                    kv.seq = _sources[i].cur->seq();
+                }
+                // 一个输入里同一个key的版本从新到老挨着，这里都跳过
+                RunCursor<K,V> *c = _sources[i].cur;
+                do {
+                    c->next();
+                } while (c->valid() && c->key() == kv.key);
+                settle(i);
+            }
+            if (kv.value != (V) TOMBSTONE){
+                _cur = kv;
+                _valid = true;
+                return;
+            }
+        }
+        _valid = false;
+    }
+};
+
+#endif /* mergeIterator_h */
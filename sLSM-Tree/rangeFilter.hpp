@@ -0,0 +1,181 @@
+//
+//  rangeFilter.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef rangeFilter_h
+#define rangeFilter_h
+
+#include <cstdint>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include "keyHash.hpp"
+
+using namespace std;
+
+// 整数key上的范围过滤器（Rosetta的做法）：把key看成无符号数，按2^4, 2^8, ..., 2^24大小的块分层，
+// 每层有key的块号都放进同一个位数组（布隆过滤器）里
+// 查[lo, hi]时先找一层让范围最多跨两个块，块不在就肯定没有；在的话往下一层细分，直到最细的一层
+// 说没有就一定没有；范围太宽（超过两个2^24的块）时不判断，直接说可能有
+template <class K>
+class RangeFilter {
+public:
+    RangeFilter(): _mask(0), _entries(0), _prev(0) {}
+
+    // keyAt(j)是第j个key，从小到大；重复的块号只加一次
+    template <class KeyAt>
+    void build(unsigned long n, KeyAt keyAt){
+        begin(count(n, keyAt));
+        for (unsigned long j = 0; j < n; ++j){
+            add(keyAt(j));
+        }
+    }
+
+    // n个从小到大的key一共有多少个不同的块（每层分别算），build按这个开位数组
+    template <class KeyAt>
+    static size_t count(unsigned long n, KeyAt keyAt){
+        size_t entries = 0;
+        for (unsigned long j = 0; j < n; ++j){
+            uint64_t u = code(keyAt(j));
+            for (int l = 0; l < LEVELS; ++l){
+                entries += j == 0 || (u >> shift(l)) != (code(keyAt(j - 1)) >> shift(l));
+            }
+        }
+        return entries;
+    }
+
+    // n个key最多有多少个块
+    static size_t maxEntries(unsigned long n){
+        return (size_t) n * LEVELS;
+    }
+
+    // 增量建：先按预计的块数开好位数组，再用add从小到大一个个加key，不用先把所有key过一遍
+    // 块数估多了只是位数组大一点，估少了误判率高一点；0表示不建，过滤器总是说可能有
+    void begin(size_t entries){
+        _bits.clear();
+        _mask = 0;
+        _entries = 0;
+        if (entries == 0){
+            return;
+        }
+        size_t words = 1;
+        while (words * 64 < entries * BITS_PER_ENTRY){
+            words <<= 1;
+        }
+        _bits.assign(words, 0);
+        _mask = words * 64 - 1;
+    }
+
+    // 加下一个key，不比上一个小
+    void add(const K &key){
+        if (_bits.empty()){
+            return;
+        }
+        uint64_t u = code(key);
+        bool first = _entries == 0;
+        for (int l = 0; l < LEVELS; ++l){
+            if (first || (u >> shift(l)) != (_prev >> shift(l))){
+                set(l, u >> shift(l));
+                ++_entries;
+            }
+        }
+        _prev = u;
+    }
+
+    // 加进去了多少个块
+    size_t entries() const {
+        return _entries;
+    }
+
+    // [lo, hi]里可能有key；没建过的过滤器总是返回true
+    bool mayContain(const K &lo, const K &hi) const {
+        if (_bits.empty()){
+            return true;
+        }
+        uint64_t a = code(lo), b = code(hi);
+        int l = 0;
+        while (l < LEVELS && (b >> shift(l)) - (a >> shift(l)) > 1){
+            ++l;
+        }
+        return l == LEVELS || probe(l, a, b);
+    }
+
+    // 位数组占多少字节
+    size_t bytes() const {
+        return _bits.size() * sizeof(uint64_t);
+    }
+
+private:
+    static const int LEVELS = 6;
+    static const int BITS_PER_ENTRY = 8;
+    static const int NUM_HASHES = 3;
+
+    static unsigned shift(int l){
+        return 4 * (l + 1);
+    }
+
+    // 保序地映射到无符号数，有符号的key也一样按大小分块
+    static uint64_t code(const K &key){
+        return (uint64_t) key - (uint64_t) numeric_limits<K>::min();
+    }
+
+    static uint64_t mix(int l, uint64_t p){
+        return mix64(p + (uint64_t) (l + 1) * 0x9e3779b97f4a7c15ULL);
+    }
+
+    void set(int l, uint64_t p){
+        uint64_t h = mix(l, p), step = (h >> 32) | 1;
+        for (int i = 0; i < NUM_HASHES; ++i, h += step){
+            _bits[(h & _mask) >> 6] |= 1ULL << (h & 63);
+        }
+    }
+
+    bool test(int l, uint64_t p) const {
+        uint64_t h = mix(l, p), step = (h >> 32) | 1;
+        for (int i = 0; i < NUM_HASHES; ++i, h += step){
+            if (!(_bits[(h & _mask) >> 6] & (1ULL << (h & 63)))){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // [a, b]在第l层最多跨两个块；在的块往下一层细分
+    bool probe(int l, uint64_t a, uint64_t b) const {
+        unsigned s = shift(l);
+        for (uint64_t p = a >> s; p <= b >> s; ++p){
+            if (!test(l, p)){
+                continue;
+            }
+            if (l == 0 || probe(l - 1, max(a, p << s), min(b, ((p + 1) << s) - 1))){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    vector<uint64_t> _bits;
+    uint64_t _mask; // 位数组的位数减一
+    size_t _entries; // 已经加了多少个块
+    uint64_t _prev;  // 上一个加进来的key
+};
+
+#endif /* rangeFilter_h */
@@ -0,0 +1,227 @@
+//
+//  rangeTombstone.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef rangeTombstone_h
+#define rangeTombstone_h
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+// 范围删除标记：删除[start, end)里序号比seq小的版本
+template <typename K>
+struct RangeTombstone {
+    K start;
+    K end;
+    uint64_t seq;
+};
+
+// 一个run上的范围删除标记集合，切成按start排好序、互不重叠的片段，查询时二分
+// 同一段上有几次范围删除就有几个start、end相同的片段，挨着放，seq从小到大
+// 范围删除只盖住序号比它小的版本：这个run里在它之后写的，和快照取在它之前的读都看不到它
+template <typename K>
+class TombstoneSet {
+public:
+    vector<RangeTombstone<K>> ranges;
+
+    bool empty() const {
+        return ranges.empty();
+    }
+
+    void clear() {
+        ranges.clear();
+    }
+
+    // 加入序号为seq的[start, end)，只重新切和它重叠或者相接的片段
+    void add(const K &start, const K &end, uint64_t seq) {
+        if (!(start < end)){
+            return;
+        }
+        auto first = lower_bound(ranges.begin(), ranges.end(), start, [](const RangeTombstone<K> &t, const K &k){ return t.end < k; });
+        auto last = first;
+        while (last != ranges.end() && !(end < last->start)){
+            ++last;
+        }
+        vector<RangeTombstone<K>> affected(first, last);
+        RangeTombstone<K> t = {start, end, seq};
+        affected.push_back(t);
+        vector<RangeTombstone<K>> pieces = fragment(affected);
+        first = ranges.erase(first, last);
+        ranges.insert(first, pieces.begin(), pieces.end());
+    }
+
+    void merge(const TombstoneSet<K> &other) {
+        if (other.ranges.empty()){
+            return;
+        }
+        if (ranges.empty()){
+            ranges = other.ranges;
+            return;
+        }
+        vector<RangeTombstone<K>> all(ranges);
+        all.insert(all.end(), other.ranges.begin(), other.ranges.end());
+        ranges = fragment(all);
+    }
+
+    // key是否被某个序号不大于asOf的范围删除覆盖
+    // 只对比这个run老的数据用：它们的版本都比这个run上的范围删除早
+    bool covers(const K &key, uint64_t asOf = UINT64_MAX) const {
+        auto it = find(key);
+        return it != ranges.end() && it->seq <= asOf;
+    }
+
+    // 覆盖key、序号比seq大的范围删除里最早的那个的序号，没有就是UINT64_MAX
+    uint64_t deletedAt(const K &key, uint64_t seq) const {
+        auto it = find(key);
+        if (it == ranges.end()){
+            return UINT64_MAX;
+        }
+        for (K start = it->start; it != ranges.end() && it->start == start; ++it){
+            if (it->seq > seq){
+                return it->seq;
+            }
+        }
+        return UINT64_MAX;
+    }
+
+    // 序号为seq的版本在asOf时是不是已经被范围删除了
+    bool hides(const K &key, uint64_t seq, uint64_t asOf = UINT64_MAX) const {
+        uint64_t t = deletedAt(key, seq);
+        return t != UINT64_MAX && t <= asOf;
+    }
+
+    // [lo, hi]（闭区间）是否整个被序号不大于asOf的范围删除覆盖
+    bool coversRange(const K &lo, const K &hi, uint64_t asOf = UINT64_MAX) const {
+        auto it = find(lo);
+        while (it != ranges.end()){
+            K start = it->start, end = it->end;
+            bool any = false;
+            for (; it != ranges.end() && it->start == start; ++it){
+                any = any || it->seq <= asOf;
+            }
+            if (!any){
+                return false;
+            }
+            if (hi < end){
+                return true;
+            }
+            if (it == ranges.end() || !(it->start == end)){
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // [lo, hi]（闭区间）里是否有key被覆盖
+    bool overlaps(const K &lo, const K &hi) const {
+        auto it = upper_bound(ranges.begin(), ranges.end(), lo, [](const K &k, const RangeTombstone<K> &t){ return k < t.end; });
+        return it != ranges.end() && !(hi < it->start);
+    }
+
+    // 和[lo, hi)有重叠的片段，片段本身不截断；查询只关心这一段时用它，不用把整个集合拷来拷去
+    TombstoneSet<K> clip(const K &lo, const K &hi) const {
+        TombstoneSet<K> out;
+        auto it = upper_bound(ranges.begin(), ranges.end(), lo, [](const K &k, const RangeTombstone<K> &t){ return k < t.end; });
+        for (; it != ranges.end() && it->start < hi; ++it){
+            out.ranges.push_back(*it);
+        }
+        return out;
+    }
+
+    // 合并完以后用：相邻两个快照之间的几次范围删除对谁都没有区别，同一段上只留其中最晚的一个
+    // snapshots从小到大；之后取的快照比所有序号都新，和不带快照的读一样
+    void compact(const vector<uint64_t> &snapshots) {
+        if (ranges.empty()){
+            return;
+        }
+        vector<RangeTombstone<K>> kept;
+        for (int i = 0; i < ranges.size(); i++){
+            bool last = i + 1 == ranges.size() || !(ranges[i + 1].start == ranges[i].start)
+                || lower_bound(snapshots.begin(), snapshots.end(), ranges[i].seq) != lower_bound(snapshots.begin(), snapshots.end(), ranges[i + 1].seq);
+            if (last){
+                kept.push_back(ranges[i]);
+            }
+        }
+        ranges = fragment(kept);
+    }
+
+private:
+    // 覆盖key的那一段的第一个片段（seq最小的），没有就是end()
+    typename vector<RangeTombstone<K>>::const_iterator find(const K &key) const {
+        // first fragment whose end is past key; fragments of one segment share start and end
+        auto it = upper_bound(ranges.begin(), ranges.end(), key, [](const K &k, const RangeTombstone<K> &t){ return k < t.end; });
+        return it != ranges.end() && !(key < it->start) ? it : ranges.end();
+    }
+
+    // 把可能重叠的范围删除切成片段：在所有端点处切开，每一段记下盖住它的所有序号，序号完全相同的相邻段再接起来
+    static vector<RangeTombstone<K>> fragment(const vector<RangeTombstone<K>> &in) {
+        vector<K> bounds;
+        for (int i = 0; i < in.size(); i++){
+            bounds.push_back(in[i].start);
+            bounds.push_back(in[i].end);
+        }
+        sort(bounds.begin(), bounds.end());
+        bounds.erase(unique(bounds.begin(), bounds.end()), bounds.end());
+        vector<RangeTombstone<K>> byStart(in);
+        sort(byStart.begin(), byStart.end(), [](const RangeTombstone<K> &a, const RangeTombstone<K> &b){ return a.start < b.start; });
+        vector<RangeTombstone<K>> out;
+        vector<uint64_t> prev, seqs;
+        unsigned long next = 0;
+        vector<RangeTombstone<K>> open;
+        for (int b = 0; b + 1 < bounds.size(); b++){
+            while (next < byStart.size() && byStart[next].start == bounds[b]){
+                open.push_back(byStart[next++]);
+            }
+            seqs.clear();
+            unsigned long w = 0;
+            for (unsigned long o = 0; o < open.size(); o++){
+                if (bounds[b] < open[o].end){
+                    seqs.push_back(open[o].seq);
+                    open[w++] = open[o];
+                }
+            }
+            open.resize(w);
+            if (seqs.empty()){
+                prev.clear();
+                continue;
+            }
+            sort(seqs.begin(), seqs.end());
+            seqs.erase(unique(seqs.begin(), seqs.end()), seqs.end());
+            if (!prev.empty() && seqs == prev){
+                for (unsigned long j = out.size() - seqs.size(); j < out.size(); j++){
+                    out[j].end = bounds[b + 1];
+                }
+                continue;
+            }
+            for (int j = 0; j < seqs.size(); j++){
+                RangeTombstone<K> t = {bounds[b], bounds[b + 1], seqs[j]};
+                out.push_back(t);
+            }
+            prev = seqs;
+        }
+        return out;
+    }
+};
+
+#endif /* rangeTombstone_h */
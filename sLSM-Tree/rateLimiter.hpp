@@ -0,0 +1,153 @@
+//
+//  rateLimiter.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef rateLimiter_h
+#define rateLimiter_h
+
+#include <cstdint>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+// 刷盘和合并的I/O限速：令牌桶，每100ms补充一次，单位是字节
+// 开启autoTune时，bytesPerSec是上限，实际速率在上限的1/20到上限之间根据需求调整：
+// 桶经常被取空说明合并跟不上，就提高速率；很少取空就降低速率，把带宽留给前台读
+class RateLimiter {
+public:
+    RateLimiter(uint64_t bytesPerSec, bool autoTune): _maxRate(bytesPerSec), _autoTune(autoTune), _drainedRefills(0), _refills(0), _totalBytes(0), _waitMicros(0) {
+        _rate = autoTune ? bytesPerSec / 2 : bytesPerSec;
+        _available = refillBytes();
+        _nextRefill = chrono::steady_clock::now() + chrono::milliseconds(REFILL_MS);
+    }
+
+    // 申请bytes字节的I/O额度，不够时睡到下一次补充
+    void request(uint64_t bytes){
+        unique_lock<mutex> lk(_lock);
+        _totalBytes += bytes;
+        while (bytes > 0){
+            refill();
+            uint64_t take = bytes < _available ? bytes : _available;
+            _available -= take;
+            bytes -= take;
+            if (bytes == 0){
+                break;
+            }
+            auto wake = _nextRefill;
+            auto start = chrono::steady_clock::now();
+            lk.unlock();
+            this_thread::sleep_until(wake);
+            lk.lock();
+            _waitMicros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    void setBytesPerSecond(uint64_t bytesPerSec){
+        lock_guard<mutex> lk(_lock);
+        _maxRate = bytesPerSec;
+        _rate = _autoTune ? bytesPerSec / 2 : bytesPerSec;
+    }
+
+    uint64_t bytesPerSecond(){
+        lock_guard<mutex> lk(_lock);
+        return _rate;
+    }
+
+    uint64_t totalBytes(){
+        lock_guard<mutex> lk(_lock);
+        return _totalBytes;
+    }
+
+    uint64_t waitMicros(){
+        lock_guard<mutex> lk(_lock);
+        return _waitMicros;
+    }
+
+    // 降低当前线程的I/O优先级（best effort里最低的一档），让后台合并读写排在前台查找的缺页之后
+    static void lowerIOPriority(){
+#ifdef __linux__
+        const int IOPRIO_CLASS_SHIFT = 13, IOPRIO_CLASS_BE = 2, IOPRIO_WHO_PROCESS = 1;
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7);
+#endif
+    }
+
+private:
+    static const int REFILL_MS = 100;
+    static const int TUNE_REFILLS = 10; // 每1s调整一次速率
+
+    uint64_t _rate;
+    uint64_t _maxRate;
+    bool _autoTune;
+    uint64_t _available;
+    chrono::steady_clock::time_point _nextRefill;
+    unsigned _drainedRefills;
+    unsigned _refills;
+    uint64_t _totalBytes;
+    uint64_t _waitMicros;
+    mutex _lock;
+
+    uint64_t refillBytes(){
+        uint64_t b = _rate * REFILL_MS / 1000;
+        return b > 0 ? b : 1;
+    }
+
+    void refill(){
+        auto now = chrono::steady_clock::now();
+        if (now < _nextRefill){
+            return;
+        }
+        if (_available == 0){
+            ++_drainedRefills;
+        }
+        ++_refills;
+        if (_autoTune && _refills == TUNE_REFILLS){
+            tune();
+        }
+        _available = refillBytes();
+        _nextRefill = now + chrono::milliseconds(REFILL_MS);
+    }
+
+    void tune(){
+        double drained = (double) _drainedRefills / _refills;
+        if (drained > .9){
+            _rate += _rate / 20;
+        }
+        else if (drained < .5){
+            _rate -= _rate / 20;
+        }
+        if (_rate > _maxRate){
+            _rate = _maxRate;
+        }
+        if (_rate < _maxRate / 20){
+            _rate = _maxRate / 20;
+        }
+        _drainedRefills = 0;
+        _refills = 0;
+    }
+};
+
+#endif /* rateLimiter_h */
@@ -0,0 +1,246 @@
+//
+//  rowCache.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef rowCache_h
+#define rowCache_h
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include "keyHash.hpp"
+
+using namespace std;
+
+#define ROW_CACHE_SHARDS 16
+
+// 热点key的缓存，放在磁盘层前面：key -> 在磁盘上查到的value（查不到或者被删除时存墓碑）
+// 分片减少锁竞争，每个分片是一个LRU；满了以后用TinyLFU决定要不要收：
+// 新key的访问频率要比LRU里最老的那个高才换进来，这样一次大扫描不会把热点key冲掉
+template <class K, class V>
+class RowCache {
+public:
+    RowCache(size_t capacity): _hits(0), _misses(0), _admitted(0), _rejected(0) {
+        size_t perShard = capacity / ROW_CACHE_SHARDS + 1;
+        for (int i = 0; i < ROW_CACHE_SHARDS; i++){
+            _shards[i].init(perShard);
+        }
+    }
+
+    bool get(const K &key, V &value){
+        uint64_t h = hashKey(key);
+        Shard &s = shardFor(h);
+        lock_guard<mutex> lk(s.lock);
+        s.sketch.increment(h);
+        auto it = s.index.find(key);
+        if (it == s.index.end()){
+            ++_misses;
+            return false;
+        }
+        // 挪到LRU的最前面
+        Entry *e = it->second;
+        s.unlink(e);
+        s.pushFront(e);
+        value = e->value;
+        ++_hits;
+        return true;
+    }
+
+    // 读磁盘之前取一下版本号，put时版本没变才放进去，防止把被并发写入作废的旧值放回缓存
+    uint64_t version(const K &key){
+        Shard &s = shardFor(hashKey(key));
+        lock_guard<mutex> lk(s.lock);
+        return s.version;
+    }
+
+    void put(const K &key, const V &value, uint64_t version){
+        uint64_t h = hashKey(key);
+        Shard &s = shardFor(h);
+        lock_guard<mutex> lk(s.lock);
+        if (s.version != version || s.index.count(key)){
+            return;
+        }
+        if (s.entries.size() >= s.capacity){
+            K victim = *s.tail.prev->key;
+            if (s.sketch.estimate(h) <= s.sketch.estimate(hashKey(victim))){
+                ++_rejected;
+                return;
+            }
+            s.remove(s.entries.find(victim));
+        }
+        auto it = s.entries.insert(make_pair(key, Entry())).first;
+        it->second.value = value;
+        it->second.key = &it->first;
+        s.pushFront(&it->second);
+        s.index[key] = &it->second;
+        ++_admitted;
+    }
+
+    // 写入和删除时作废
+    void erase(const K &key){
+        Shard &s = shardFor(hashKey(key));
+        lock_guard<mutex> lk(s.lock);
+        ++s.version;
+        if (s.index.count(key)){
+            s.remove(s.entries.find(key));
+        }
+    }
+
+    // 作废[key1, key2)里的所有key，范围删除用；每个分片在有序的entries上找到这一段，只动落在里面的key
+    void eraseRange(const K &key1, const K &key2){
+        for (int i = 0; i < ROW_CACHE_SHARDS; i++){
+            Shard &s = _shards[i];
+            lock_guard<mutex> lk(s.lock);
+            ++s.version;
+            auto first = s.entries.lower_bound(key1), last = s.entries.lower_bound(key2);
+            while (first != last){
+                s.remove(first++);
+            }
+        }
+    }
+
+    uint64_t hits(){ return _hits; }
+    uint64_t misses(){ return _misses; }
+    uint64_t admitted(){ return _admitted; }
+    uint64_t rejected(){ return _rejected; }
+
+    double hitRate(){
+        uint64_t total = _hits + _misses;
+        return total ? (double) _hits / total : 0;
+    }
+
+private:
+    // 访问频率的估计：4行的count-min sketch，8位计数器
+    // 计数总数到了10倍容量时所有计数器减半，让过时的热点慢慢冷下去
+    struct FrequencySketch {
+        vector<uint8_t> table;
+        uint64_t mask;
+        uint64_t additions;
+        uint64_t sampleSize;
+
+        void init(size_t capacity){
+            uint64_t width = 64;
+            while (width < capacity * 4){
+                width <<= 1;
+            }
+            table.assign(width, 0);
+            mask = width - 1;
+            additions = 0;
+            sampleSize = capacity * 10;
+        }
+
+        uint64_t slot(uint64_t h, int row){
+            uint64_t x = (h ^ (row * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+            return (x >> 29) & mask;
+        }
+
+        void increment(uint64_t h){
+            for (int r = 0; r < 4; r++){
+                uint8_t &c = table[slot(h, r)];
+                if (c < 255){
+                    ++c;
+                }
+            }
+            if (++additions >= sampleSize){
+                for (size_t i = 0; i < table.size(); i++){
+                    table[i] >>= 1;
+                }
+                additions /= 2;
+            }
+        }
+
+        uint8_t estimate(uint64_t h){
+            uint8_t m = 255;
+            for (int r = 0; r < 4; r++){
+                uint8_t c = table[slot(h, r)];
+                m = c < m ? c : m;
+            }
+            return m;
+        }
+    };
+
+    // 缓存的一项，挂在分片的LRU链表上
+    struct Entry {
+        V value;
+        const K *key; // entries里的key
+        Entry *prev;
+        Entry *next;
+    };
+
+    // 每一项只存一份，放在按key排好序的entries里：点查走index，范围删除在entries上找到那一段，LRU链表穿过这些项
+    struct Shard {
+        mutex lock;
+        map<K, Entry> entries;
+        unordered_map<K, Entry *> index;
+        Entry head; // LRU的哨兵：head.next最新，tail.prev最老
+        Entry tail;
+        FrequencySketch sketch;
+        size_t capacity;
+        uint64_t version;
+
+        void init(size_t cap){
+            capacity = cap;
+            version = 0;
+            sketch.init(cap);
+            head.prev = tail.next = nullptr;
+            head.next = &tail;
+            tail.prev = &head;
+        }
+
+        void pushFront(Entry *e){
+            e->prev = &head;
+            e->next = head.next;
+            head.next->prev = e;
+            head.next = e;
+        }
+
+        void unlink(Entry *e){
+            e->prev->next = e->next;
+            e->next->prev = e->prev;
+        }
+
+        void remove(typename map<K, Entry>::iterator it){
+            unlink(&it->second);
+            index.erase(it->first);
+            entries.erase(it);
+        }
+    };
+
+    Shard _shards[ROW_CACHE_SHARDS];
+    atomic<uint64_t> _hits;
+    atomic<uint64_t> _misses;
+    atomic<uint64_t> _admitted;
+    atomic<uint64_t> _rejected;
+
+    static uint64_t hashKey(const K &key){
+        return KeyHash<K>::hash64(key);
+    }
+
+    Shard &shardFor(uint64_t h){
+        return _shards[h % ROW_CACHE_SHARDS];
+    }
+};
+
+#endif /* rowCache_h */
@@ -34,6 +34,7 @@ struct KVPair {
     
     K key;
     V value;
+    uint64_t seq; // 写入序号，同一个key序号大的更新
     
     // bool tombstone;
 
@@ -55,6 +56,32 @@ struct KVPair {
     }
 };
 
+// 磁盘run文件（C_level_runID.txt和导入的run文件）里的一个KV，文件就是这个结构体的数组原样mmap的
+// 不带seq：int的key和value带上8字节的seq要16字节，磁盘占用和合并、扫描读写的字节数都翻倍。
+// run里的KV默认共用一个序号，只有快照要区分同一个run里的版本时才另外留每个KV的序号，见DiskRun::seqAt
+template <typename K, typename V>
+struct DiskPair {
+    K key;
+    V value;
+};
+
+
+// run上的游标：不拷贝数据，直接在run里按key从小到大走，同一个key的多个版本从新到老
+// seek定位到第一个不小于key的元素；用完要delete
+template <class K, class V>
+class RunCursor {
+
+public:
+    virtual void seek(const K &key) = 0;
+    virtual void seekToFirst() = 0;
+    virtual bool valid() = 0;
+    virtual void next() = 0;
+    virtual K key() = 0;
+    virtual V value() = 0;
+    virtual uint64_t seq() { return 0; } // 写入序号，没有记录序号的run都是0
+    virtual ~RunCursor() { }
+
+};
 
 template <class K, class V>
 class Run {
@@ -63,12 +90,19 @@ public:
     virtual K get_min() = 0;
     virtual K get_max() = 0;
     virtual void insert_key(const K &key, const V &value) = 0;
+    // 带写入序号；被覆盖的旧版本序号不大于snapshotSeq时还有快照要看，留着
+    virtual void insert_key(const K &key, const V &value, uint64_t seq, uint64_t snapshotSeq) = 0;
+    // 一批按key排好序、没有重复的KV，共用一个写入序号
+    virtual void insert_batch(const KVPair<K,V> *kvs, unsigned long n, uint64_t seq, uint64_t snapshotSeq) = 0;
     virtual void delete_key(const K &key) = 0;
     virtual V lookup(const K &key, bool &found) = 0;
+    // 序号不大于asOf的最新版本，seq返回它的序号
+    virtual V lookup(const K &key, bool &found, uint64_t &seq, uint64_t asOf) = 0;
     virtual unsigned long long num_elements() = 0;
     virtual void set_size(const unsigned long size) = 0;
     virtual vector<KVPair<K,V>> get_all() = 0;
     virtual vector<KVPair<K,V>> get_all_in_range(const K &key1, const K &key2) = 0;
+    virtual RunCursor<K,V> * cursor() = 0;
     virtual ~Run() { } // 析构函数
 
 };
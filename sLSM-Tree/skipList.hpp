@@ -28,6 +28,7 @@
 #include <random>
 #include <vector>
 #include <string>
+#include <atomic>
 
 #include "run.hpp"
 using namespace std;
@@ -39,6 +40,14 @@ default_random_engine generator;
 uniform_real_distribution<double> distribution(0.0,1.0);
 const double NODE_PROBABILITY = 0.5;
 
+// 被覆盖但还有快照要看的旧版本，从新到老串起来
+template<class V>
+struct SkipList_Version {
+    V value;
+    uint64_t seq;
+    SkipList_Version<V> *next;
+};
+
 // skipList节点类
 template<class K,class V, unsigned MAXLEVEL>
 class SkipList_Node {
@@ -46,22 +55,30 @@ class SkipList_Node {
 public:
     const K key;
     V value;
+    uint64_t seq; // 写入序号
+    SkipList_Version<V> *older; // 旧版本，通常为空
     SkipList_Node<K,V,MAXLEVEL>* _forward[MAXLEVEL+1];
     
     // 两个构造函数；注意下标从1开始
-    SkipList_Node(const K searchKey):key(searchKey) {
+    SkipList_Node(const K searchKey):key(searchKey),seq(0),older(NULL) {
         for (int i=1; i<=MAXLEVEL; i++) {
             _forward[i] = NULL;
         }
     }
     
-    SkipList_Node(const K searchKey,const V val):key(searchKey),value(val) {
+    SkipList_Node(const K searchKey,const V val,uint64_t sq = 0):key(searchKey),value(val),seq(sq),older(NULL) {
         for (int i=1; i<=MAXLEVEL; i++) {
             _forward[i] = NULL;
         }
     }
     
-    virtual ~SkipList_Node(){}
+    virtual ~SkipList_Node(){
+        while (older){
+            SkipList_Version<V> *v = older;
+            older = older->next;
+            delete v;
+        }
+    }
 };
 
 // skipList类；Run的派生类
@@ -74,6 +91,56 @@ public:
     // 跳表节点新名字：Node
     typedef SkipList_Node<K,V,MAXLEVEL> Node;
 
+    typedef SkipList_Version<V> Version;
+
+    // 跳表上的游标，seek走上层索引，O(log n)；同一个节点先给出当前版本，再给出旧版本
+    class Cursor : public RunCursor<K,V> {
+    public:
+        Cursor(SkipList *list): _list(list), _node(list->p_listTail), _ver(NULL) {}
+
+        void seek(const K &key){
+            _node = _list->find_greater_or_equal(key);
+            _ver = NULL;
+        }
+
+        void seekToFirst(){
+            _node = _list->p_listHead->_forward[1];
+            _ver = NULL;
+        }
+
+        bool valid(){
+            return _node != _list->p_listTail;
+        }
+
+        void next(){
+            Version *nx = _ver ? _ver->next : _node->older;
+            if (nx){
+                _ver = nx;
+            }
+            else {
+                _node = _node->_forward[1];
+                _ver = NULL;
+            }
+        }
+
+        K key(){
+            return _node->key;
+        }
+
+        V value(){
+            return _ver ? _ver->value : _node->value;
+        }
+
+        uint64_t seq(){
+            return _ver ? _ver->seq : _node->seq;
+        }
+
+    private:
+        SkipList *_list;
+        Node *_node;
+        Version *_ver; // 为空表示在节点的当前版本上
+    };
+
     const int max_level; // 最大层数
     K min;
     K max;
@@ -82,12 +149,13 @@ public:
     // 头节点指向尾节点，cur_max_level=1
     SkipList(const K minKey,const K maxKey):p_listHead(NULL),p_listTail(NULL),
     cur_max_level(1),max_level(MAXLEVEL), min((K) NULL), max((K) NULL),
-    _minKey(minKey),_maxKey(maxKey), _n(0)
+    _minKey(minKey),_maxKey(maxKey), _n(0), _id(nextListId()), _version(0)
     {
         p_listHead = new Node(_minKey);
         p_listTail = new Node(_maxKey);
         for (int i=1; i<=MAXLEVEL; i++) {
             p_listHead->_forward[i] = p_listTail;
+            _last[i] = p_listHead;
         }
     }
 
@@ -106,6 +174,10 @@ public:
 
     // 插入节点
     void insert_key(const K &key, const V &value) {
+        insert_key(key, value, 0, 0);
+    }
+
+    void insert_key(const K &key, const V &value, uint64_t seq, uint64_t snapshotSeq) {
         if (key > max){
             max = key;
         }
@@ -116,25 +188,56 @@ public:
         Node* update[MAXLEVEL];
         Node* currNode = p_listHead;
 
-        // level从cur_max_level走到最小为1。如果下一个节点比key小，
-        // 找到每一层比插入的key小的最大key，存到update里去
-        for(int level = cur_max_level; level > 0; level--) {
-            while (currNode->_forward[level]->key < key) {
-                currNode = currNode->_forward[level];
+        // 顺序写入：key比表里所有的key都大时，每一层的前驱就是这一层的最后一个节点，直接接在尾巴上，不用从头找
+        if (_last[1] == p_listHead || _last[1]->key < key) {
+            for (int level = 1; level <= cur_max_level; level++) {
+                update[level] = _last[level];
             }
-            update[level] = currNode;
+            saveFinger(update);
+            currNode = p_listTail;
         }
-        // currNode为第一层比插入的key小的最大key节点
-        currNode = currNode->_forward[1];
-        if (currNode->key == key) {
+        else {
+            // currNode为第一个不小于key的节点
+            currNode = findPath(key, update);
+        }
+        place(update, currNode, key, value, seq, snapshotSeq);
+    }
+
+    // 一批按key从小到大排好、没有重复的KV，共用一个写入序号
+    // 每个key都从上一个key的finger开始找，不用每次从头走
+    void insert_batch(const KVPair<K,V> *kvs, unsigned long n, uint64_t seq, uint64_t snapshotSeq) {
+        for (unsigned long i = 0; i < n; i++) {
+            insert_key(kvs[i].key, kvs[i].value, seq, snapshotSeq);
+        }
+    }
+
+    // 在找好的位置上写入：currNode是第一个不小于key的节点，update是每一层的前驱
+    void place(Node** update, Node* currNode, const K &key, const V &value, uint64_t seq, uint64_t snapshotSeq) {
+        if (currNode != p_listTail && currNode->key == key) {
             // update the value if the key already exists
-            currNode->value = value;
+            if (seq >= currNode->seq){
+                if (currNode->seq != 0 && currNode->seq <= snapshotSeq){
+                    currNode->older = new Version{currNode->value, currNode->seq, currNode->older};
+                    ++_n; // 旧版本也要刷到磁盘，算进元素个数
+                }
+                currNode->value = value;
+                currNode->seq = seq;
+            }
+            else if (seq <= snapshotSeq){
+                // an older version arriving late (copying a run): keep the chain newest first
+                Version **p = &currNode->older;
+                while (*p && (*p)->seq > seq){
+                    p = &(*p)->next;
+                }
+                *p = new Version{value, seq, *p};
+                ++_n;
+            }
         }
         else {
             // if key isn't in the list, insert a new node! yes!
             int insertLevel = generateNodeLevel();
             
-            if (insertLevel > cur_max_level && insertLevel < MAXLEVEL - 1) {
+            if (insertLevel > cur_max_level) {
                 // 从第二层开始到插入的那一层
                 for (int lv = cur_max_level + 1; lv <= insertLevel; lv++) {
                     update[lv] = p_listHead;
@@ -142,78 +245,167 @@ public:
                 cur_max_level = insertLevel;
             }
 
-            currNode = new Node(key,value);
+            currNode = new Node(key,value,seq);
 
-            for (int level = 1; level <= cur_max_level; level++) {
+            // 只接到自己那一层，高层稀疏了才能跳着找
+            for (int level = 1; level <= insertLevel; level++) {
+                // 从finger来的高层前驱可能不是紧挨着的，先往后走到紧挨着的
+                while (update[level]->_forward[level]->key < key) {
+                    update[level] = update[level]->_forward[level];
+                }
                 currNode->_forward[level] = update[level]->_forward[level];
                 update[level]->_forward[level] = currNode;
+                if (currNode->_forward[level] == p_listTail) {
+                    _last[level] = currNode;
+                }
             }
             ++_n;
 
         }
-        
-        
     }
 
     // 删除节点
     void delete_key(const K &searchKey) {
         //            SkipList_Node<K,V,MAXLEVEL>* update[MAXLEVEL];
         Node* update[MAXLEVEL];
-        Node* currNode = p_listHead;
-        for(int level=cur_max_level; level >=1; level--) {
-            // 如果key比searchKey小，继续往后找
-            while (currNode->_forward[level]->key < searchKey) {
-                currNode = currNode->_forward[level];
-            }
-            // 每层大于等于searchKey的最小key节点
-            update[level] = currNode;
-        }
-        currNode = currNode->_forward[1];
-        if (currNode->key == searchKey) {
+        // 每层小于searchKey的最大key节点存在update里，currNode是第一个不小于searchKey的
+        Node* currNode = findPath(searchKey, update);
+        if (currNode != p_listTail && currNode->key == searchKey) {
+            ++_version; // 节点要被释放了，各个线程手里的finger都作废
             for (int level = 1; level <= cur_max_level; level++) {
+                while (update[level]->_forward[level]->key < searchKey) {
+                    update[level] = update[level]->_forward[level];
+                }
                 if (update[level]->_forward[level] != currNode) {
                     break;
                 }
                 // level层有searchKey的话，删除
                 update[level]->_forward[level] = currNode->_forward[level];
+                if (_last[level] == currNode) {
+                    _last[level] = update[level];
+                }
             }
             delete currNode;
             // update the max level
             while (cur_max_level > 1 && p_listHead->_forward[cur_max_level] == NULL) {
                 cur_max_level--;
             }
+            _n--;
         }
-        _n--;
     }
 
-    //查找节点
-    V lookup(const K &searchKey, bool &found) {
+    // 第一个不小于searchKey的节点，没有的话是尾节点
+    Node* find_greater_or_equal(const K &searchKey) {
+        Node* update[MAXLEVEL];
+        return findPath(searchKey, update);
+    }
+
+    // 每个线程记着自己上一次在哪个跳表的哪里找过（每一层的前驱，也就是update[]），叫finger
+    // 下一个key在它后面时从finger开始找，不用从头走；在它前面或者finger已经作废时从头找
+    struct Finger {
+        uint64_t list;     // 哪个跳表，0表示没有
+        uint64_t version;  // 记下时跳表的_version
+        int top;           // 记下时的层数
+        Node* path[MAXLEVEL];
+    };
+
+    static Finger &finger() {
+        static thread_local Finger f = {0, 0, 0, {}};
+        return f;
+    }
+
+    static uint64_t nextListId() {
+        static atomic<uint64_t> ids(0);
+        return ++ids;
+    }
+
+    void saveFinger(Node** update) {
+        Finger &f = finger();
+        f.list = _id;
+        f.version = _version;
+        f.top = cur_max_level;
+        for (int level = 1; level <= cur_max_level; level++) {
+            f.path[level] = update[level];
+        }
+    }
+
+    // 找每一层比key小的最大节点存进update，返回第一个不小于key的节点；找完把路径记成finger
+    Node* findPath(const K &key, Node** update) {
+        Finger &f = finger();
         Node* currNode = p_listHead;
-        for(int level=cur_max_level; level >=1; level--) {
-            while (currNode->_forward[level]->key < searchKey) {
-                currNode = currNode->_forward[level];
+        if (f.list == _id && f.version == _version && f.top == cur_max_level && (f.path[1] == p_listHead || f.path[1]->key < key)) {
+            // 从finger的第一层往上爬，爬到下一个节点不小于key的那层为止，再从那里往下找
+            // 上一个key和key相距d时只爬O(log d)层，每层走的步数是常数，所以是O(log d)而不是O(log n)
+            // 爬到的那层以上沿用finger：finger里每层都比key小，只是别的线程插过节点时不一定是紧挨着的前驱，place会往后补
+            int top = 1;
+            while (top < cur_max_level && f.path[top]->_forward[top]->key < key) {
+                ++top;
+            }
+            for (int level = cur_max_level; level > top; level--) {
+                update[level] = f.path[level];
+            }
+            currNode = f.path[top];
+            for (int level = top; level > 0; level--) {
+                // 取上一层下来的位置和finger里靠后的那个
+                if (f.path[level] != p_listHead && (currNode == p_listHead || currNode->key < f.path[level]->key)) {
+                    currNode = f.path[level];
+                }
+                while (currNode->_forward[level]->key < key) {
+                    currNode = currNode->_forward[level];
+                }
+                update[level] = currNode;
             }
         }
-        currNode = currNode->_forward[1];
-        if (currNode->key == searchKey) {
+        else {
+            // level从cur_max_level走到最小为1。如果下一个节点比key小，
+            // 找到每一层比key小的最大key，存到update里去
+            for (int level = cur_max_level; level > 0; level--) {
+                while (currNode->_forward[level]->key < key) {
+                    currNode = currNode->_forward[level];
+                }
+                update[level] = currNode;
+            }
+        }
+        saveFinger(update);
+        return currNode->_forward[1];
+    }
+
+    //查找节点
+    V lookup(const K &searchKey, bool &found) {
+        uint64_t seq;
+        return lookup(searchKey, found, seq, UINT64_MAX);
+    }
+
+    V lookup(const K &searchKey, bool &found, uint64_t &seq, uint64_t asOf) {
+        Node* currNode = find_greater_or_equal(searchKey);
+        if (currNode->key != searchKey) {
+            return (V) NULL;
+        }
+        if (currNode->seq <= asOf){
             found = true;
+            seq = currNode->seq;
             return currNode->value;
         }
-        else {
-            return (V) NULL;
+        for (Version *v = currNode->older; v; v = v->next){
+            if (v->seq <= asOf){
+                found = true;
+                seq = v->seq;
+                return v->value;
+            }
         }
+        return (V) NULL;
     }
 
     // 把所有节点取出来存到vector里返回
     vector<KVPair<K,V>> get_all(){
         // KVPair vector
         vector<KVPair<K,V>> vec = vector<KVPair<K, V>>();
+        vec.reserve(_n);
         // auto可以在声明变量的时候根据变量初始值的类型自动为此变量选择匹配的类型
         auto node = p_listHead->_forward[1];
         while ( node != p_listTail){
-            KVPair<K,V> kv = {node->key, node->value};
+            KVPair<K,V> kv = {node->key, node->value, node->seq};
             vec.push_back(kv);
-            // TODO: optimize by reserving space before hand
             node = node->_forward[1];
         }
         return vec;
@@ -227,15 +419,12 @@ public:
         }
         
         vector<KVPair<K,V>> vec = vector<KVPair<K, V>>();
-        auto node = p_listHead->_forward[1];
-        // node最后是key大于等于key1的最小key节点
-        while ( node->key < key1){
-            node = node->_forward[1];
-        }
+        // node是key大于等于key1的最小key节点
+        auto node = find_greater_or_equal(key1);
 
         // 所以key1 <= key2吧
         while ( node->key < key2){
-            KVPair<K,V> kv = {node->key, node->value};
+            KVPair<K,V> kv = {node->key, node->value, node->seq};
             vec.push_back(kv);
             node = node->_forward[1];
         }
@@ -244,6 +433,10 @@ public:
         
     }
 
+    RunCursor<K,V> * cursor(){
+        return new Cursor(this);
+    }
+
     // element是否存在
     bool eltIn(K &key) {
         return lookup(key);
@@ -281,10 +474,22 @@ public:
     
     //    private:
 
-    // 没有懂
+    // 节点层数，1到MAXLEVEL-1，每高一层概率减半
+    // 随机数用每个线程自己的xorshift64：rand()要拿libc的全局锁，多个分片一起写时都在这里排队
     int generateNodeLevel() {
-        // ffs()函数用于查找一个整数中的第一个置位值(也就是bit为1的位)。
-        return ffs(rand() & ((1 << MAXLEVEL) - 1)) - 1;
+        static thread_local uint64_t state = levelSeed();
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        // ffs()函数用于查找一个整数中的第一个置位值(也就是bit为1的位)。全是0时取最高层
+        int level = ffs((int) (state >> 32) & ((1 << (MAXLEVEL - 2)) - 1));
+        return level == 0 ? MAXLEVEL - 1 : level;
+    }
+
+    // 每个线程的初始状态不一样，也不能是0
+    static uint64_t levelSeed() {
+        static atomic<uint64_t> next(0);
+        return ++next * 0x9e3779b97f4a7c15ULL;
     }
     
     K _minKey;
@@ -294,7 +499,10 @@ public:
     int cur_max_level; // 目前的最大层
     Node* p_listHead; // 跳表的头指针
     Node* p_listTail; // 跳表的尾指针
+    Node* _last[MAXLEVEL+1]; // 每一层的最后一个节点，顺序写入时直接往后接
     uint32_t _keysPerLevel[MAXLEVEL];
+    uint64_t _id;       // 全局唯一的编号，finger靠它认跳表
+    uint64_t _version;  // 每删除一个节点加一
     
 };
 
@@ -0,0 +1,88 @@
+//
+//  snapshot.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef snapshot_h
+#define snapshot_h
+
+#include <cstdint>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+
+// 快照：序号不大于seq的写入对它可见
+struct Snapshot {
+    uint64_t seq;
+};
+
+// 还活着的快照，刷盘和合并时据此决定老版本要不要留
+class SnapshotList {
+public:
+    SnapshotList(): _newest(0) {}
+
+    // 取当前的写入序号做快照
+    // 先把_newest设成最大值再读序号：读到序号之后才写入的线程一定能看到这个快照（或者最大值），不会丢掉快照要的旧版本
+    const Snapshot * acquire(const atomic<uint64_t> &seq){
+        lock_guard<mutex> lk(_lock);
+        _newest.store(UINT64_MAX);
+        Snapshot *s = new Snapshot();
+        s->seq = seq.load();
+        _seqs.insert(s->seq);
+        _newest.store(*_seqs.rbegin());
+        return s;
+    }
+
+    void release(const Snapshot *s){
+        lock_guard<mutex> lk(_lock);
+        _seqs.erase(_seqs.find(s->seq));
+        _newest.store(_seqs.empty() ? 0 : *_seqs.rbegin());
+        delete s;
+    }
+
+    // 从小到大
+    vector<uint64_t> seqs(){
+        lock_guard<mutex> lk(_lock);
+        return vector<uint64_t>(_seqs.begin(), _seqs.end());
+    }
+
+    // 最新的快照，没有快照时为0；写入路径上每次都要读，所以不加锁
+    uint64_t newest() const {
+        return _newest.load();
+    }
+
+    // 同一个key的一个老版本（序号seq）后面紧跟着序号newerSeq的新版本，
+    // 只有存在快照S满足seq <= S < newerSeq时老版本才还有人看得到
+    static bool visible(const vector<uint64_t> &snapshots, uint64_t seq, uint64_t newerSeq){
+        auto it = lower_bound(snapshots.begin(), snapshots.end(), seq);
+        return it != snapshots.end() && *it < newerSeq;
+    }
+
+private:
+    multiset<uint64_t> _seqs;
+    mutex _lock;
+    atomic<uint64_t> _newest;
+};
+
+#endif /* snapshot_h */
@@ -0,0 +1,84 @@
+//
+//  writeBatch.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef writeBatch_h
+#define writeBatch_h
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// 一批写入和删除，交给LSM::write一次性生效：整批共用一个写入序号，快照要么全看到要么全看不到
+// 同一个key以批里最后一次操作为准
+template <class K, class V>
+class WriteBatch {
+public:
+    struct Op {
+        K key;
+        V value;
+        bool del;
+    };
+
+    void put(const K &key, const V &value){
+        Op op = {key, value, false};
+        _ops.push_back(op);
+    }
+
+    void remove(const K &key){
+        Op op = {key, V(), true};
+        _ops.push_back(op);
+    }
+
+    void clear(){
+        _ops.clear();
+    }
+
+    size_t size() const {
+        return _ops.size();
+    }
+
+    bool empty() const {
+        return _ops.empty();
+    }
+
+    // 按key排好序，同一个key只留最后一次操作
+    const vector<Op> &sorted(){
+        stable_sort(_ops.begin(), _ops.end(), [](const Op &a, const Op &b){ return a.key < b.key; });
+        unsigned long w = 0;
+        for (unsigned long r = 0; r < _ops.size(); r++){
+            if (w > 0 && _ops[w - 1].key == _ops[r].key){
+                _ops[w - 1] = _ops[r];
+            }
+            else {
+                _ops[w++] = _ops[r];
+            }
+        }
+        _ops.resize(w);
+        return _ops;
+    }
+
+private:
+    vector<Op> _ops;
+};
+
+#endif /* writeBatch_h */
@@ -0,0 +1,178 @@
+//
+//  writeController.hpp
+//  lsm-tree
+//
+//    sLSM: Skiplist-Based LSM Tree
+//    Copyright © 2017 Aron Szanto. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//        You should have received a copy of the GNU General Public License
+//        along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#ifndef writeController_h
+#define writeController_h
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+// 写入限流：合并跟不上时，根据积压的合并工作量（debt，单位是KV个数）逐级放慢写入，
+// 积压低于slowdown时不限速；在slowdown和stop之间用令牌桶限速，积压越多速率越低；超过stop时写入停下来等合并
+class WriteController {
+public:
+    enum State { NORMAL = 0, DELAYED = 1, STOPPED = 2 };
+
+    WriteController(): _slowdownDebt(0), _stopDebt(0), _delayedRate(0), _sealedDebt(0), _compactionDebt(0), _state(NORMAL), _stallMicros(0), _delayedWrites(0), _stops(0), _tokens(0) {
+        _lastRefill = chrono::steady_clock::now();
+    }
+
+    // slowdownDebt为0表示关闭限流；delayedRate是刚进入限速时每秒允许的写入数
+    void configure(unsigned long slowdownDebt, unsigned long stopDebt, double delayedRate){
+        lock_guard<mutex> lk(_lock);
+        _slowdownDebt = slowdownDebt;
+        _stopDebt = stopDebt > slowdownDebt ? stopDebt : slowdownDebt + 1;
+        _delayedRate = delayedRate;
+        updateState();
+    }
+
+    // 积压来自两部分：还没刷盘的封存缓冲区，和磁盘层之间还没做的合并
+    void setSealedDebt(unsigned long debt){
+        lock_guard<mutex> lk(_lock);
+        _sealedDebt = debt;
+        updateState();
+    }
+
+    void setCompactionDebt(unsigned long debt){
+        lock_guard<mutex> lk(_lock);
+        _compactionDebt = debt;
+        updateState();
+    }
+
+    // 每次写入前调用；正常状态下只是读一个原子变量
+    void throttle(){
+        if (_state.load(memory_order_relaxed) == NORMAL){
+            return;
+        }
+        unique_lock<mutex> lk(_lock);
+        if (_state == STOPPED){
+            auto start = chrono::steady_clock::now();
+            ++_stops;
+            _cv.wait(lk, [this]{ return _state != STOPPED; });
+            _stallMicros += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        }
+        if (_state != DELAYED){
+            return;
+        }
+        ++_delayedWrites;
+        refill();
+        _tokens -= 1;
+        if (_tokens >= 0){
+            return;
+        }
+        // sleep in chunks of at least a millisecond instead of once per write
+        double rate = currentRate();
+        long micros = (long) (-_tokens / rate * 1000000);
+        if (micros < 1000){
+            return;
+        }
+        lk.unlock();
+        this_thread::sleep_for(chrono::microseconds(micros));
+        lk.lock();
+        _stallMicros += micros;
+    }
+
+    State state(){
+        return (State) _state.load();
+    }
+
+    unsigned long debt(){
+        lock_guard<mutex> lk(_lock);
+        return _sealedDebt + _compactionDebt;
+    }
+
+    unsigned long stallMicros(){
+        lock_guard<mutex> lk(_lock);
+        return _stallMicros;
+    }
+
+    unsigned long delayedWrites(){
+        lock_guard<mutex> lk(_lock);
+        return _delayedWrites;
+    }
+
+    unsigned long stops(){
+        lock_guard<mutex> lk(_lock);
+        return _stops;
+    }
+
+private:
+    unsigned long _slowdownDebt;
+    unsigned long _stopDebt;
+    double _delayedRate;
+    unsigned long _sealedDebt;
+    unsigned long _compactionDebt;
+    atomic<int> _state;
+    unsigned long _stallMicros;     // 写线程因为限流而等待的总时间
+    unsigned long _delayedWrites;   // 在限速状态下完成的写入数
+    unsigned long _stops;           // 写入被完全停下的次数
+    double _tokens;
+    chrono::steady_clock::time_point _lastRefill;
+    mutex _lock;
+    condition_variable _cv;
+
+    // 积压从slowdown涨到stop时，速率从_delayedRate线性降到它的1/10
+    double currentRate(){
+        unsigned long debt = _sealedDebt + _compactionDebt;
+        double over = (double) (debt - _slowdownDebt) / (double) (_stopDebt - _slowdownDebt);
+        if (over > 1) over = 1;
+        return _delayedRate * (1 - .9 * over);
+    }
+
+    void refill(){
+        auto now = chrono::steady_clock::now();
+        double secs = chrono::duration<double>(now - _lastRefill).count();
+        _lastRefill = now;
+        double rate = currentRate();
+        _tokens += secs * rate;
+        if (_tokens > rate / 100){
+            _tokens = rate / 100; // at most 10ms of burst
+        }
+    }
+
+    void updateState(){
+        unsigned long debt = _sealedDebt + _compactionDebt;
+        int next = NORMAL;
+        if (_slowdownDebt != 0 && debt >= _stopDebt){
+            next = STOPPED;
+        }
+        else if (_slowdownDebt != 0 && debt >= _slowdownDebt){
+            next = DELAYED;
+        }
+        if (next == DELAYED && _state != DELAYED){
+            _tokens = 0;
+            _lastRefill = chrono::steady_clock::now();
+        }
+        _state = next;
+        if (next != STOPPED){
+            _cv.notify_all();
+        }
+    }
+};
+
+#endif /* writeController_h */